@@ -1,5 +1,21 @@
 #include "PtyProcess.h"
 
+#ifdef PLATFORM_POSIX
+#include <spawn.h>
+#endif
+
+// posix_spawn() can only stand in for fork() when it can also start a new session, attach the
+// controlling terminal and change the working directory of the child on its own. With glibc on
+// Linux (2.29+) this is possible: POSIX_SPAWN_SETSID runs before the file actions, and opening
+// the pty slave in a session leader without O_NOCTTY makes it the controlling terminal.
+
+#if defined(PLATFORM_LINUX) && defined(__GLIBC__) && defined(POSIX_SPAWN_SETSID)
+	#if __GLIBC_PREREQ(2, 29)
+		#define PTY_POSIX_SPAWN
+		extern char **environ;
+	#endif
+#endif
+
 namespace Upp {
 
 #define LLOG(x)	// RLOG("PtyProcess [POSIX]: " << x);
@@ -11,6 +27,21 @@ static void sNoBlock(int fd)
 	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 }
 
+static void sWriteAll(int fd, const char *s, int len)
+{
+	while(len > 0) {
+		int n = write(fd, s, len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0) {
+			LLOG("Couldn't write to the recording, errno = " << errno);
+			break;
+		}
+		s += n;
+		len -= n;
+	}
+}
+
 bool sParseEnv(Vector<const char*>& out, const char* penv)
 {
 	if(penv) {
@@ -91,7 +122,21 @@ void PtyProcess::Init()
 	master = -1;
 	slave  = -1;
 	convertcharset = false;
+	fastspawn = true;
 	exit_code = Null;
+	readlimit = 65536;
+	readpending = false;
+	logfd = timingfd = -1;
+	rpipe[0] = rpipe[1] = -1;
+	lpipe[0] = lpipe[1] = -1;
+	rtime = 0;
+	rowned = false;
+}
+
+PtyProcess::~PtyProcess()
+{
+	Kill();
+	StopRecording();
 }
 
 void PtyProcess::Free()
@@ -112,6 +157,22 @@ void PtyProcess::Free()
 	}
 }
 
+void PtyProcess::Adopt(PtyProcess& p)
+{
+	Kill();
+	master      = p.master;
+	slave       = p.slave;
+	pid         = p.pid;
+	sname       = pick(p.sname);
+	exit_string = pick(p.exit_string);
+	wbuffer     = pick(p.wbuffer);
+	exit_code   = p.exit_code;
+	p.master    = -1;
+	p.slave     = -1;
+	p.pid       = 0;
+	p.exit_code = Null;
+}
+
 bool PtyProcess::Start(const char *cmdline, const VectorMap<String, String>& env, const char *cd)
 {
 	String senv;
@@ -173,7 +234,12 @@ bool PtyProcess::DoStart(const char *cmd, const Vector<String> *args, const char
 		LLOG("Setting user-defined termios flags for initial pty setup.");
 		SetAttrs(tio);
 	}
-	
+
+#ifdef PTY_POSIX_SPAWN
+	if(fastspawn)
+		return Spawn(fullpath, vargs, env, cd);
+#endif
+
 	pid = fork();
 	if(pid < 0) {
 		LLOG("fork() failed.");
@@ -264,19 +330,101 @@ bool PtyProcess::DoStart(const char *cmd, const Vector<String> *args, const char
 	return true;
 }
 
+bool PtyProcess::Spawn(const String& fullpath, Vector<char*>& vargs, const char *env, const char *cd)
+{
+#ifdef PTY_POSIX_SPAWN
+	// This is the posix_spawn() equivalent of the fork() path in DoStart(). glibc implements it
+	// with a vfork-style clone that shares the address space of the parent, so its cost doesn't
+	// grow with the parent's memory footprint. The child ends up in the same state: new session,
+	// default signal dispositions, empty signal mask, the pty slave as its controlling terminal
+	// on stdin/out/err (non-blocking, as above) and the requested working directory.
+
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_t actions;
+
+	if(posix_spawnattr_init(&attr) != 0) {
+		LLOG("posix_spawnattr_init() failed.");
+		Free();
+		return false;
+	}
+
+	if(posix_spawn_file_actions_init(&actions) != 0) {
+		LLOG("posix_spawn_file_actions_init() failed.");
+		posix_spawnattr_destroy(&attr);
+		Free();
+		return false;
+	}
+
+	sigset_t sigdef, sigmask;
+	sigfillset(&sigdef);
+	sigemptyset(&sigmask);
+
+	bool ok = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK) == 0
+		&& posix_spawnattr_setsigdefault(&attr, &sigdef) == 0
+		&& posix_spawnattr_setsigmask(&attr, &sigmask) == 0
+		&& posix_spawn_file_actions_addclose(&actions, master) == 0
+		&& posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, ~sname, O_RDWR | O_NONBLOCK, 0) == 0
+		&& posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDOUT_FILENO) == 0
+		&& posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDERR_FILENO) == 0;
+
+	// The fork() path ignores chdir() errors, but a failing file action would abort the spawn.
+	if(ok && cd && DirectoryExists(cd))
+		ok = posix_spawn_file_actions_addchdir_np(&actions, cd) == 0;
+
+	int err = ENOMEM;
+	if(ok) {
+		Vector<const char*> venv;
+		char* const* penv = env && sParseEnv(venv, env) ? (char* const*) venv.begin() : ::environ;
+		err = posix_spawn(&pid, fullpath, &actions, &attr, vargs.begin(), penv);
+	}
+
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+
+	if(err != 0) {
+		LLOG("posix_spawn() failed, errno = " << err);
+		pid = 0;
+		Free();
+		return false;
+	}
+
+	sNoBlock(master);
+	return true;
+#else
+	return false;
+#endif
+}
+
 bool PtyProcess::Read(String& s)
 {
+	return Read(s, readlimit);
+}
+
+bool PtyProcess::Read(String& s, int limit)
+{
+	// At most 'limit' bytes are read per call, so that a single session that produces
+	// output faster than it is consumed can't monopolize the caller. The rest is left
+	// in the kernel's pty buffer, which in turn throttles the producer. IsReadPending()
+	// tells the caller that the limit was hit and more output is likely to be waiting.
+
 	String rread;
 	constexpr int BUFSIZE = 4096;
 
+	if(limit <= 0)
+		limit = INT_MAX;
+
+	readpending = false;
 	bool running = IsRunning() || master >= 0;
 	if(running && Wait(WAIT_READ, 0)) { // Poll
 		char buffer[BUFSIZE];
 		int n = 0, done = 0;
-		while((n = read(master, buffer, BUFSIZE)) > 0) {
+		while(done < limit && (n = ReadMaster(buffer, min(BUFSIZE, limit - done))) > 0) {
 			done += n;
 			rread.Cat(buffer, n);
 		}
+		readpending = done >= limit;
+		if(timingfd >= 0 && done > 0)
+			WriteTiming(done);
 		LLOG("Read() -> " << done << " bytes read.");
 		if(n == 0) {
 			close(master);
@@ -348,6 +496,135 @@ bool PtyProcess::IsRunning()
 	return false;
 }
 
+bool PtyProcess::Record(const char *logpath, const char *timingpath)
+{
+	// The log is only ever appended to, but it is not opened with O_APPEND, because
+	// splice(2) refuses such files. We start at the end of the file and are its only writer.
+
+	StopRecording();
+
+	int fd = open(logpath, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+	if(fd < 0) {
+		LLOG("Couldn't open the recording log: " << logpath);
+		return false;
+	}
+
+	int tfd = -1;
+	if(timingpath && (tfd = open(timingpath, O_WRONLY | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+		LLOG("Couldn't open the recording timing file: " << timingpath);
+		close(fd);
+		return false;
+	}
+
+	lseek(fd, 0, SEEK_END);
+	if(tfd >= 0)
+		lseek(tfd, 0, SEEK_END);
+
+	Record(fd, tfd);
+	rowned = true;
+	return true;
+}
+
+bool PtyProcess::Record(int fd, int tfd)
+{
+	// Everything read from the pty master is copied to 'fd' as is, before the charset
+	// conversion. If 'tfd' is valid, a "<delay> <bytecount>" line, in the timing format
+	// of script(1), is written to it for each Read() call, so that the log can be replayed
+	// with scriptreplay(1). The caller retains the ownership of the descriptors.
+
+	StopRecording();
+	if(fd < 0)
+		return false;
+
+	logfd    = fd;
+	timingfd = tfd;
+	rowned   = false;
+	rtime    = usecs();
+
+#ifdef PLATFORM_LINUX
+	if((fcntl(fd, F_GETFL) & O_APPEND) || pipe2(rpipe, O_CLOEXEC) < 0 || pipe2(lpipe, O_CLOEXEC) < 0) {
+		LLOG("Falling back to user-space copies for the recording.");
+		StopSplicing();
+	}
+#endif
+	return true;
+}
+
+void PtyProcess::StopRecording()
+{
+	StopSplicing();
+	if(rowned) {
+		if(logfd >= 0)
+			close(logfd);
+		if(timingfd >= 0)
+			close(timingfd);
+	}
+	logfd = timingfd = -1;
+	rowned = false;
+}
+
+void PtyProcess::StopSplicing()
+{
+	for(int *fd : { rpipe, rpipe + 1, lpipe, lpipe + 1 })
+		if(*fd >= 0) {
+			close(*fd);
+			*fd = -1;
+		}
+}
+
+int PtyProcess::ReadMaster(char *buffer, int len)
+{
+	if(logfd < 0)
+		return read(master, buffer, len);
+
+#ifdef PLATFORM_LINUX
+	if(rpipe[0] >= 0) {
+		// The output is moved from the master into a pipe, and tee(2) duplicates it into a
+		// second pipe, whose content is then spliced into the log. The data we read back
+		// from the first pipe is the only copy that reaches the user space.
+		int n = (int) splice(master, nullptr, rpipe[1], nullptr, len, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+		if(n < 0 && errno != EAGAIN) {
+			// E.g. the pty driver does not support splicing (EINVAL).
+			LLOG("splice() failed, errno = " << errno << ". Falling back to user-space copies.");
+			StopSplicing();
+			return ReadMaster(buffer, len);
+		}
+		if(n <= 0)
+			return n;
+		int t = (int) tee(rpipe[0], lpipe[1], n, SPLICE_F_NONBLOCK);
+		n = read(rpipe[0], buffer, n);
+		if(n <= 0)
+			return n;
+		int w = 0;
+		while(w < t) {
+			int k = (int) splice(lpipe[0], nullptr, logfd, nullptr, t - w, SPLICE_F_MOVE);
+			if(k <= 0)
+				break;
+			w += k;
+		}
+		if(w < n) {
+			LLOG("splice() or tee() failed, errno = " << errno << ". Falling back to user-space copies.");
+			StopSplicing(); // Also drops the data left in the second pipe.
+			sWriteAll(logfd, buffer + w, n - w);
+		}
+		return n;
+	}
+#endif
+
+	int n = read(master, buffer, len);
+	if(n > 0)
+		sWriteAll(logfd, buffer, n);
+	return n;
+}
+
+void PtyProcess::WriteTiming(int n)
+{
+	int64 t = usecs();
+	String s = Format("%.6f %d\n", (t - rtime) / 1000000.0, n);
+	rtime = t;
+	sWriteAll(timingfd, ~s, s.GetLength());
+}
+
 bool PtyProcess::DecodeExitCode(int status)
 {
 	if(WIFEXITED(status)) {
@@ -0,0 +1,211 @@
+#include "PtyProcess.h"
+
+namespace Upp {
+
+#define LLOG(x)	// RLOG("PtyProcessPool: " << x);
+
+// The pool keeps a number of shells spawned, sized and idle, so that a new terminal
+// page can take one over instead of waiting for the pty allocation, the process spawn
+// and the shell's own startup. Idle shells are replenished by a worker thread.
+
+PtyProcessPool::PtyProcessPool()
+{
+	pagesize = Size(80, 24);
+	capacity = 2;
+	serial   = 0;
+	quit     = false;
+}
+
+PtyProcessPool::~PtyProcessPool()
+{
+	Stop();
+}
+
+void PtyProcessPool::Reset()
+{
+	// Idle processes, and the ones being spawned, are no longer usable once the setup changes.
+	// They are destroyed outside of the lock, as their destructors wait for the processes.
+	Array<PtyProcess> drop;
+	{
+		Mutex::Lock __(lock);
+		drop = pick(idle);
+		serial++;
+		cv.Signal();
+	}
+}
+
+PtyProcessPool& PtyProcessPool::Command(const char *s)
+{
+	{
+		Mutex::Lock __(lock);
+		cmdline = s;
+	}
+	Reset();
+	return *this;
+}
+
+PtyProcessPool& PtyProcessPool::Environment(const char *s)
+{
+	{
+		Mutex::Lock __(lock);
+		env.Clear();
+		if(s)
+			for(const char *p = s; *p; p += strlen(p) + 1)
+				env.Cat(p, (int) strlen(p) + 1);
+	}
+	Reset();
+	return *this;
+}
+
+PtyProcessPool& PtyProcessPool::Environment(const VectorMap<String, String>& venv)
+{
+	String s;
+	for(int i = 0; i < venv.GetCount(); i++)
+		s << venv.GetKey(i) << "=" << venv[i] << '\0';
+	return Environment(~s);
+}
+
+PtyProcessPool& PtyProcessPool::WorkingDirectory(const char *s)
+{
+	{
+		Mutex::Lock __(lock);
+		cd = s;
+	}
+	Reset();
+	return *this;
+}
+
+PtyProcessPool& PtyProcessPool::Capacity(int n)
+{
+	Array<PtyProcess> drop;
+	{
+		Mutex::Lock __(lock);
+		capacity = max(0, n);
+		while(idle.GetCount() > capacity)
+			drop.Add(idle.Detach(idle.GetCount() - 1));
+		cv.Signal();
+	}
+	return *this;
+}
+
+PtyProcessPool& PtyProcessPool::PageSize(Size sz)
+{
+	Mutex::Lock __(lock);
+	pagesize = sz;
+	for(PtyProcess& p : idle)
+		p.SetSize(sz);
+	return *this;
+}
+
+void PtyProcessPool::Start()
+{
+	if(worker.IsOpen())
+		return;
+	quit = false;
+	worker.Run([=] { Work(); });
+}
+
+void PtyProcessPool::Stop()
+{
+	if(worker.IsOpen()) {
+		{
+			Mutex::Lock __(lock);
+			quit = true;
+			cv.Signal();
+		}
+		worker.Wait();
+	}
+	Array<PtyProcess> drop;
+	{
+		Mutex::Lock __(lock);
+		drop = pick(idle);
+	}
+}
+
+int PtyProcessPool::GetIdleCount() const
+{
+	Mutex::Lock __(lock);
+	return idle.GetCount();
+}
+
+bool PtyProcessPool::Spawn(PtyProcess& p, Size sz)
+{
+	String scmd, senv, scd;
+	{
+		Mutex::Lock __(lock);
+		scmd = cmdline;
+		senv = env;
+		scd  = cd;
+	}
+	if(IsNull(scmd) || !p.Start(~scmd, IsNull(senv) ? nullptr : ~senv, IsNull(scd) ? nullptr : ~scd))
+		return false;
+	p.SetSize(sz);
+	return true;
+}
+
+bool PtyProcessPool::Get(PtyProcess& p, Size sz)
+{
+	One<PtyProcess> q;
+	Size psz;
+	{
+		Mutex::Lock __(lock);
+		while(!idle.IsEmpty()) {
+			q.Attach(idle.Detach(0));
+			if(q->IsRunning())
+				break;
+			LLOG("Dropping an idle process that has exited.");
+			q.Clear();
+		}
+		psz = pagesize;
+		cv.Signal();
+	}
+
+	if(!q) {
+		LLOG("Pool is empty, starting the process in place.");
+		return Spawn(p, sz);
+	}
+
+	p.Adopt(*q);
+	if(sz != psz)
+		p.SetSize(sz);
+	return true;
+}
+
+void PtyProcessPool::Work()
+{
+	LLOG("Worker started.");
+	for(;;) {
+		Size sz;
+		int  n;
+		{
+			Mutex::Lock __(lock);
+			while(!quit && idle.GetCount() >= capacity)
+				cv.Wait(lock);
+			if(quit)
+				break;
+			sz = pagesize;
+			n  = serial;
+		}
+		// The spawn is done outside of the lock, so that Get() never waits for it.
+		One<PtyProcess> p;
+		p.Create();
+		if(!Spawn(*p, sz)) {
+			LLOG("Couldn't spawn a process for the pool.");
+			Mutex::Lock __(lock);
+			if(!quit)
+				cv.Wait(lock, 1000);
+			continue;
+		}
+		Mutex::Lock __(lock);
+		if(quit)
+			break;
+		if(n != serial)
+			continue;
+		if(p->GetSize() != pagesize)
+			p->SetSize(pagesize);
+		idle.Add(p.Detach());
+		LLOG("Idle processes: " << idle.GetCount() << "/" << capacity);
+	}
+	LLOG("Worker stopped.");
+}
+}
@@ -20,11 +20,17 @@ public:
     PtyProcess(const char *cmdline, const VectorMap<String, String>& env, const char *cd = nullptr)                 { Init(); Start(cmdline, env, cd); }
     PtyProcess(const char *cmdline, const char *env = nullptr, const char *cd = nullptr)                            { Init(); Start(cmdline, nullptr, env, cd); }
     PtyProcess(const char *cmd, const Vector<String> *args, const char *env = nullptr, const char *cd = nullptr)    { Init(); Start(cmd, args, env, cd); }
-    virtual ~PtyProcess()                                                                                           { Kill(); }
+    virtual ~PtyProcess();
 
     PtyProcess& ConvertCharset(bool b = true)       { convertcharset = b; return *this; }
     PtyProcess& NoConvertCharset()                  { return ConvertCharset(false); }
 
+    PtyProcess& FastSpawn(bool b = true)            { fastspawn = b; return *this; }
+    PtyProcess& NoFastSpawn()                       { return FastSpawn(false); }
+
+    PtyProcess& ReadLimit(int n)                    { readlimit = n; return *this; }
+    int         GetReadLimit() const                { return readlimit; }
+
     bool        SetSize(Size sz);
     bool        SetSize(int col, int row)           { return SetSize(Size(col, row)); }
     Size        GetSize();
@@ -33,6 +39,11 @@ public:
     bool        SetAttrs(const termios& t);
     bool        GetAttrs(termios& t);
     Gate<termios&> WhenAttrs;
+
+    bool        Record(const char *logpath, const char *timingpath = nullptr);
+    bool        Record(int logfd, int timingfd = -1);
+    void        StopRecording();
+    bool        IsRecording() const                 { return logfd >= 0; }
 #endif
 
     bool        Start(const char *cmdline, const char *env = nullptr, const char *cd = nullptr)                         { return DoStart(cmdline, nullptr, env, cd); }
@@ -43,6 +54,8 @@ public:
     bool        IsRunning() override;
 
     bool        Read(String& s) override;
+    bool        Read(String& s, int limit);
+    bool        IsReadPending() const               { return readpending; }
     void        Write(String s) override;
 
     int         GetExitCode() override;
@@ -54,12 +67,19 @@ public:
 #endif
 
 private:
+    friend class PtyProcessPool;
+
     void        Init();
     void        Free();
+    void        Adopt(PtyProcess& p);
     bool        DoStart(const char *cmd, const Vector<String> *args, const char *env, const char *cd);
 
 #ifdef PLATFORM_POSIX
+    bool        Spawn(const String& fullpath, Vector<char*>& vargs, const char *env, const char *cd);
     bool        ResetSignals();
+    int         ReadMaster(char *buffer, int len);
+    void        StopSplicing();
+    void        WriteTiming(int n);
     bool        Wait(dword event, int ms = 10);
     bool        DecodeExitCode(int status);
 
@@ -67,6 +87,10 @@ private:
     String      exit_string;
     String      sname;
     pid_t       pid;
+    int         logfd, timingfd;
+    int         rpipe[2], lpipe[2];
+    int64       rtime;
+    bool        rowned;
 #elif PLATFORM_WIN32
 	#ifdef flagWIN10
     // Windows 10 pseudoconsole API support. (Experimental)
@@ -86,7 +110,50 @@ private:
 #endif
     String      wbuffer;
     int         exit_code;
+    int         readlimit;
+    bool        readpending;
     bool        convertcharset;
+    bool        fastspawn;
+};
+
+class PtyProcessPool : NoCopy {
+public:
+    PtyProcessPool();
+    virtual ~PtyProcessPool();
+
+    PtyProcessPool& Command(const char *cmdline);
+    PtyProcessPool& Environment(const char *env);
+    PtyProcessPool& Environment(const VectorMap<String, String>& env);
+    PtyProcessPool& WorkingDirectory(const char *cd);
+    PtyProcessPool& Capacity(int n);
+    PtyProcessPool& PageSize(Size sz);
+    PtyProcessPool& PageSize(int col, int row)      { return PageSize(Size(col, row)); }
+
+    void        Start();
+    void        Stop();
+    bool        IsStarted() const                   { return worker.IsOpen(); }
+
+    bool        Get(PtyProcess& p, Size sz);
+    bool        Get(PtyProcess& p, int col, int row){ return Get(p, Size(col, row)); }
+
+    int         GetIdleCount() const;
+
+private:
+    void        Reset();
+    bool        Spawn(PtyProcess& p, Size sz);
+    void        Work();
+
+    Array<PtyProcess> idle;
+    Thread      worker;
+    mutable Mutex lock;
+    ConditionVariable cv;
+    String      cmdline;
+    String      env;
+    String      cd;
+    Size        pagesize;
+    int         capacity;
+    int         serial;
+    bool        quit;
 };
 }
 
@@ -139,7 +139,15 @@ void PtyProcess::Init()
 #endif
 	cSize          = Null;
 	convertcharset = false;
+	fastspawn      = true;
 	exit_code      = Null;
+	readlimit      = 65536;
+	readpending    = false;
+}
+
+PtyProcess::~PtyProcess()
+{
+	Kill();
 }
 
 void PtyProcess::Free()
@@ -180,6 +188,31 @@ void PtyProcess::Free()
 #endif
 }
 
+void PtyProcess::Adopt(PtyProcess& p)
+{
+	Kill();
+	hProcess         = p.hProcess;
+	hConsole         = p.hConsole;
+	hOutputRead      = p.hOutputRead;
+	hErrorRead       = p.hErrorRead;
+	hInputWrite      = p.hInputWrite;
+	dwProcessId      = p.dwProcessId;
+#ifdef flagWIN10
+	hProcAttrList    = p.hProcAttrList;
+	p.hProcAttrList  = nullptr;
+#endif
+	cSize            = p.cSize;
+	rbuffer          = pick(p.rbuffer);
+	wbuffer          = pick(p.wbuffer);
+	exit_code        = p.exit_code;
+	p.hProcess       = nullptr;
+	p.hConsole       = nullptr;
+	p.hOutputRead    = nullptr;
+	p.hErrorRead     = nullptr;
+	p.hInputWrite    = nullptr;
+	p.exit_code      = Null;
+}
+
 bool PtyProcess::Start(const char *cmdline, const VectorMap<String, String>& env, const char *cd)
 {
 	String senv;
@@ -355,9 +388,19 @@ bool PtyProcess::DoStart(const char *cmd, const Vector<String> *args, const char
 
 bool PtyProcess::Read(String& s)
 {
+	return Read(s, readlimit);
+}
+
+bool PtyProcess::Read(String& s, int limit)
+{
+	// See PosixPty.cpp: the pipes' buffers throttle the producer while we are busy elsewhere.
+
 	String rread;
 	constexpr const int BUFSIZE = 4096;
 
+	if(limit <= 0)
+		limit = INT_MAX;
+
 	s = rbuffer;
 	rbuffer.Clear();
 	bool running = IsRunning();
@@ -365,17 +408,21 @@ bool PtyProcess::Read(String& s)
 	dword n = 0;
 
 	while(hOutputRead
+		&& rread.GetLength() < limit
 		&& PeekNamedPipe(hOutputRead, nullptr, 0, nullptr, &n, nullptr)
 		&& n
-		&& ReadFile(hOutputRead, buffer, sizeof(buffer), &n, nullptr) && n)
+		&& ReadFile(hOutputRead, buffer, min(BUFSIZE, limit - rread.GetLength()), &n, nullptr) && n)
 			rread.Cat(buffer, n);
 
 	while(hErrorRead
+		&& rread.GetLength() < limit
 		&& PeekNamedPipe(hErrorRead, nullptr, 0, nullptr, &n, nullptr)
 		&& n
-		&& ReadFile(hErrorRead, buffer, sizeof(buffer), &n, nullptr) && n)
+		&& ReadFile(hErrorRead, buffer, min(BUFSIZE, limit - rread.GetLength()), &n, nullptr) && n)
 			rread.Cat(buffer, n);
 
+	readpending = rread.GetLength() >= limit;
+
 	LLOG("Read() -> " << rread.GetLength() << " bytes read.");
 
 	if(!IsNull(rread)) {
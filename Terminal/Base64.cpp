@@ -0,0 +1,159 @@
+#include "Base64.h"
+
+#define LLOG(x)		// RLOG("VTBase64Decoder: " << x)
+#define LTIMING(x)	// RTIMING(x)
+
+namespace Upp {
+
+static constexpr dword INVALID = 0x01000000;
+
+struct sBase64Tables {
+	dword d[4][256];
+	byte  v[256];                                           // Sextets, 0xFF: not in the alphabet.
+	sBase64Tables()
+	{
+		memset(v, 0xFF, sizeof(v));
+		const char *a = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		for(int i = 0; i < 64; i++)
+			v[(byte) a[i]] = i;
+		v['-'] = 62; // URL-safe alphabet.
+		v['_'] = 63;
+		for(int c = 0; c < 256; c++) {
+			dword x = v[c];
+			if(x == 0xFF) {
+				d[0][c] = d[1][c] = d[2][c] = d[3][c] = INVALID;
+				continue;
+			}
+			// The output bytes are stored in memory order (little endian).
+			d[0][c] = x << 2;
+			d[1][c] = (x >> 4) | ((x & 0x0F) << 12);
+			d[2][c] = ((x >> 2) << 8) | ((x & 0x03) << 22);
+			d[3][c] = x << 16;
+		}
+	}
+};
+
+static const sBase64Tables& sTables()
+{
+	static sBase64Tables t;
+	return t;
+}
+
+void VTBase64Decoder::Clear()
+{
+	out.Clear();
+	ptr = end = nullptr;
+	npending = 0;
+	done = false;
+}
+
+void VTBase64Decoder::Grow(int n)
+{
+	// Keeps 4 bytes of slack after 'end', as the fast path writes whole words.
+	int64 used = ptr ? ptr - out.Begin() : 0;
+	int64 sz   = max<int64>(used + n, 2 * (end ? end - out.Begin() : 0));
+	sz = min<int64>(sz, INT_MAX - 8);
+	out.SetLength((int)(sz + 4));
+	ptr = out.Begin() + used;
+	end = out.Begin() + sz;
+}
+
+void VTBase64Decoder::Reserve(int64 len)
+{
+	int64 n = (len + 3) / 4 * 3;
+	if(!end || end - ptr < n)
+		Grow((int) min<int64>(n, INT_MAX - 8));
+}
+
+void VTBase64Decoder::Put(const char *s, int len)
+{
+	LTIMING("VTBase64Decoder::Put");
+
+	if(done || len <= 0)
+		return;
+
+	const char *e = s + len;
+	Reserve(len + npending);
+
+	// Completes a quartet that was split between the chunks.
+	while(npending && s < e && !done) {
+		PutSlow(s, s + 1);
+		s++;
+	}
+
+	const sBase64Tables& t = sTables();
+	const byte *p = (const byte *) s;
+	const byte *pe = (const byte *) e;
+	while(!done && p < pe) {
+		while(pe - p >= 8) {
+			dword a = t.d[0][p[0]] | t.d[1][p[1]] | t.d[2][p[2]] | t.d[3][p[3]];
+			dword b = t.d[0][p[4]] | t.d[1][p[5]] | t.d[2][p[6]] | t.d[3][p[7]];
+			if((a | b) & 0xFF000000)
+				break;
+			Poke32le(ptr, a);
+			Poke32le(ptr + 3, b);
+			ptr += 6;
+			p += 8;
+		}
+		if(p == pe)
+			break;
+		// Whitespace, padding or invalid characters: The slow path takes one quartet.
+		const byte *q = p;
+		int n = 0;
+		while(q < pe && n < 4)
+			if(t.v[*q++] != 0xFF || q[-1] == '=')
+				n++;
+		PutSlow((const char *) p, (const char *) q);
+		p = q;
+	}
+}
+
+void VTBase64Decoder::PutSlow(const char *s, const char *e)
+{
+	const sBase64Tables& t = sTables();
+	for(; s < e && !done; s++) {
+		byte c = *s;
+		if(c == '=') {
+			// The partial quartet is flushed, and the rest of the input is ignored.
+			done = true;
+			break;
+		}
+		byte x = t.v[c];
+		if(x == 0xFF)
+			continue;
+		pending[npending++] = x;
+		if(npending == 4) {
+			ptr[0] = (pending[0] << 2) | (pending[1] >> 4);
+			ptr[1] = (pending[1] << 4) | (pending[2] >> 2);
+			ptr[2] = (pending[2] << 6) | pending[3];
+			ptr += 3;
+			npending = 0;
+		}
+	}
+}
+
+String VTBase64Decoder::GetResult()
+{
+	if(!ptr)
+		return String();
+	if(npending >= 2)
+		*ptr++ = (pending[0] << 2) | (pending[1] >> 4);
+	if(npending >= 3)
+		*ptr++ = (pending[1] << 4) | (pending[2] >> 2);
+	npending = 0;
+	out.SetLength((int)(ptr - out.Begin()));
+	String s = out;
+	Clear();
+	return s;
+}
+
+String VTBase64Decoder::Decode(const char *s, int len)
+{
+	LTIMING("VTBase64Decoder::Decode");
+
+	VTBase64Decoder d;
+	d.Put(s, len);
+	return d.GetResult();
+}
+
+}
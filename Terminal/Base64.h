@@ -0,0 +1,43 @@
+#ifndef _VTBase64_h_
+#define _VTBase64_h_
+
+#include <Core/Core.h>
+
+namespace Upp {
+
+// A table-driven base64 decoder for the inline image payloads. Four input characters are
+// decoded by four table lookups into a single 32-bit word, and any character that is not in
+// the alphabet sets its high byte, so the common case takes no per-character branches. The
+// rest (whitespace, padding, invalid characters) is handled by a slower path, which skips
+// them. Both the standard and the URL-safe alphabets are accepted.
+//
+// The decoder is incremental: The input can be passed to Put() in arbitrarily split chunks,
+// and the output is written to a buffer preallocated by Reserve().
+
+class VTBase64Decoder {
+public:
+    VTBase64Decoder()                                       { Clear(); }
+
+    void            Reserve(int64 len);                     // Expected input length.
+    void            Put(const char *s, int len);
+    void            Put(const String& s)                    { Put(~s, s.GetLength()); }
+    String          GetResult();
+    void            Clear();
+
+    static String   Decode(const char *s, int len);
+    static String   Decode(const String& s)                 { return Decode(~s, s.GetLength()); }
+
+private:
+    void            PutSlow(const char *s, const char *e);
+    void            Grow(int n);
+
+    StringBuffer    out;
+    char           *ptr;
+    char           *end;                                    // Reserved, excluding the slack.
+    byte            pending[4];
+    int             npending;
+    bool            done;                                   // Padding was seen.
+};
+
+}
+#endif
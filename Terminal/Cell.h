@@ -6,7 +6,7 @@
 namespace Upp {
 
 struct VTCell : Moveable<VTCell> {
-    dword   chr; // TODO: Grapheme support.
+    dword   chr; // Code point, image id, or grapheme cluster reference (see Cluster).
     union {
         dword data;
         struct {
@@ -40,6 +40,12 @@ struct VTCell : Moveable<VTCell> {
         SGR_HYPERLINK   = 0x0400
     };
 
+    enum Cluster : dword {
+        CLUSTER            = 0x80000000, // chr is an index into the page's cluster table.
+        CLUSTER_WIDE       = 0x40000000,
+        CLUSTER_MASK       = 0x3FFFFFFF
+    };
+
     enum FillerFlags : dword {
         FILL_NORMAL        = 0x0000,
         FILL_DEC_SELECTIVE = 0x0001,
@@ -75,7 +81,29 @@ struct VTCell : Moveable<VTCell> {
     VTCell& Ink(Color c)                     { ink = c; return *this;   }
     VTCell& Paper(Color c)                   { paper = c; return *this; }
 
+    enum WidthClass : byte {
+        WIDTH_NORMAL = 0,
+        WIDTH_ZERO,
+        WIDTH_WIDE,
+        WIDTH_AMBIGUOUS,
+        WIDTH_UNKNOWN
+    };
+
+    enum UnicodeVersion : byte {
+        UNICODE_13 = 13,
+        UNICODE_14 = 14
+    };
+
     int  GetWidth() const;
+
+    static int  GetCharWidth(dword c);
+    static int  GetWidthClass(dword c);
+
+    static void SetUnicodeVersion(int v);
+    static int  GetUnicodeVersion();
+
+    static void SetAmbiguousCharWidth(int w);
+    static int  GetAmbiguousCharWidth();
     
     bool IsVoid() const                      { return this == &Void();       }
     bool IsNormal() const                    { return sgr == SGR_NORMAL;     }
@@ -90,6 +118,7 @@ struct VTCell : Moveable<VTCell> {
     bool IsConcealed() const                 { return sgr & SGR_HIDDEN;      }
     bool IsImage() const                     { return sgr & SGR_IMAGE;       }
     bool IsHyperlink() const                 { return sgr & SGR_HYPERLINK;   }
+    bool IsCluster() const                   { return (chr & CLUSTER) && !(sgr & SGR_IMAGE); }
     bool IsProtected() const                 { return attrs & ATTR_PROTECTION_ALL; }
     bool HasDECProtection() const            { return attrs & ATTR_PROTECTION_DEC; }
     bool HasISOProtection() const            { return attrs & ATTR_PROTECTION_ISO; }
@@ -97,6 +126,12 @@ struct VTCell : Moveable<VTCell> {
 
     void    Fill(const VTCell& filler, dword flags);
 
+    // Bulk versions of Fill(): Copy() fills each cell from the respective source cell.
+    // FILL_NORMAL is a plain store (or memmove). The other flags are applied by branch-free,
+    // masked loops. The source and destination of a masked Copy() must not overlap.
+    static void Fill(VTCell *cells, int n, const VTCell& filler, dword flags);
+    static void Copy(VTCell *dst, const VTCell *src, int n, dword flags);
+
     void    Reset();
     
     void    Clear()                             { Reset(); chr = 0; attrs = 0; }
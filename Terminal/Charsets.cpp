@@ -199,6 +199,7 @@ TerminalCtrl::GSets::GSets(byte defgset)
 
 TerminalCtrl::GSets::GSets(byte g0, byte g1, byte g2, byte g3)
 {
+	l = r = 0;
 	d[0] = g0;
 	d[1] = g1;
 	d[2] = g2;
@@ -233,6 +234,18 @@ void TerminalCtrl::GSets::ConformtoANSILevel3()
 	G0toGL();
 }
 
+void TerminalCtrl::GSets::Sync()
+{
+	// Single shifts and the DEC graphics sets (which are honored even when the g-sets are
+	// overridden) are the only cases where the code points are translated in UTF-8 mode.
+
+	byte gl = g[l];
+	identity = ss == 0x00
+		&& gl != CHARSET_DEC_DCS
+		&& gl != CHARSET_DEC_TCS
+		&& gl != CHARSET_DEC_VT52;
+}
+
 void TerminalCtrl::GSets::Reset()
 {
 	ss = 0;
@@ -274,12 +287,13 @@ void TerminalCtrl::GSets::Serialize(Stream& s)
 		g[1] = CharsetByName(v[5]);
 		g[2] = CharsetByName(v[6]);
 		g[3] = CharsetByName(v[7]);
-		clamp(l, 0, 3);
-		clamp(r, 0, 3);
+		l = clamp(l, 0, 3);
+		r = clamp(r, 0, 3);
 		if(ss != 0x00
 		&& ss != 0x8E
 		&& ss != 0x8F)
 			ss = 0;
+		Sync();
 	}
 }
 
@@ -312,12 +326,13 @@ void TerminalCtrl::GSets::Jsonize(JsonIO& jio)
 		g[1] = CharsetByName(vm[5]);
 		g[2] = CharsetByName(vm[6]);
 		g[3] = CharsetByName(vm[7]);
-		clamp(l, 0, 3);
-		clamp(r, 0, 3);
+		l = clamp(l, 0, 3);
+		r = clamp(r, 0, 3);
 		if(ss != 0x00
 		&& ss != 0x8E
 		&& ss != 0x8F)
 			ss = 0;
+		Sync();
 	}
 }
 
@@ -10,7 +10,7 @@ void TerminalCtrl::ParseCommandSequences(const VTInStream::Sequence& seq)
 	LLOG(seq);
 
 	const CbFunction *p = FindFunctionPtr(seq);
-	if(p) p->c(*this, seq);
+	if(p) p->fn(*this, seq);
 }
 
 void TerminalCtrl::ClearPage(const VTInStream::Sequence& seq, dword flags)
@@ -700,7 +700,8 @@ void TerminalCtrl::ReportRectAreaChecksum(const VTInStream::Sequence& seq)
 
 		const VTCell& cell = page->GetCell(pt);
 		if(!cell.IsVoid()) {
-			checksum -= cell.chr == 0 ? 0x20 : EncodeCodepoint(cell, gsets.Get(cell, IsLevel2()));
+			int c = cell.IsCluster() ? page->GetCluster(cell.chr)[0] : (int) cell.chr;
+			checksum -= c == 0 ? 0x20 : EncodeCodepoint(c, gsets.Get(c, IsLevel2()));
 			if(cell.IsUnderlined())
 				checksum -= 0x10;
 			if(cell.IsInverted())
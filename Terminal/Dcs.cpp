@@ -10,7 +10,7 @@ void TerminalCtrl::ParseDeviceControlStrings(const VTInStream::Sequence& seq)
 	LLOG(seq);
 
 	const CbFunction *p = FindFunctionPtr(seq);
-	if(p) p->c(*this, seq);
+	if(p) p->fn(*this, seq);
 }
 
 void TerminalCtrl::SetUserDefinedKeys(const VTInStream::Sequence& seq)
@@ -13,7 +13,7 @@ void TerminalCtrl::ParseEscapeSequences(const VTInStream::Sequence& seq)
 		return;
 
 	const CbFunction *p = FindFunctionPtr(seq);
-	if(p) p->c(*this, seq);
+	if(p) p->fn(*this, seq);
 }
 
 bool TerminalCtrl::Convert7BitC1To8BitC1(const VTInStream::Sequence& seq)
@@ -0,0 +1,378 @@
+#include "Export.h"
+
+#define LLOG(x)		// RLOG("VTExporter: " << x)
+#define LTIMING(x)	// RTIMING(x)
+
+namespace Upp {
+
+static constexpr word SGR_VISIBLE = ~(VTCell::SGR_IMAGE | VTCell::SGR_HYPERLINK);
+
+static void sPutUtf8(String& s, dword c)
+{
+	if(c < 0x80)
+		s.Cat(c);
+	else
+	if(c < 0x800) {
+		s.Cat(0xC0 | (c >> 6));
+		s.Cat(0x80 | (c & 0x3F));
+	}
+	else
+	if(c < 0x10000) {
+		s.Cat(0xE0 | (c >> 12));
+		s.Cat(0x80 | ((c >> 6) & 0x3F));
+		s.Cat(0x80 | (c & 0x3F));
+	}
+	else {
+		s.Cat(0xF0 | (c >> 18));
+		s.Cat(0x80 | ((c >> 12) & 0x3F));
+		s.Cat(0x80 | ((c >> 6) & 0x3F));
+		s.Cat(0x80 | (c & 0x3F));
+	}
+}
+
+static Color sCubeColor(int i)
+{
+	// 256-color palette: 6x6x6 color cube and grayscale ramp.
+	if(i < 232)
+		return Color(((i - 16) / 36) * 51, (((i - 16) % 36) / 6) * 51, ((i - 16) % 6) * 51);
+	int g = (i - 232) * 10 + 8;
+	return Color(g, g, g);
+}
+
+static String sDecorations(const VTCell& cell)
+{
+	String s;
+	if(cell.IsUnderlined())
+		s.Cat('u');
+	if(cell.IsOverlined())
+		s.Cat('o');
+	if(cell.IsStrikeout())
+		s.Cat('s');
+	return s;
+}
+
+VTExporter::VTExporter()
+: format(VTEXPORT_TEXT)
+, rectsel(false)
+, tspaces(true)
+#ifdef PLATFORM_WIN32
+, eol("\r\n")
+#else
+, eol("\n")
+#endif
+, out(nullptr)
+, span(false)
+, first(true)
+, wrapped(false)
+{
+}
+
+bool VTExporter::Export(const VTPage& page, const Rect& r, Stream& s)
+{
+	LTIMING("VTExporter::Export(page)");
+
+	Begin(s);
+	bool ok = page.FetchRange(r, [&](const VTLine& line, VTLine::ConstRange& range, int blanks) -> bool {
+		PutLine(line.IsWrapped());
+		for(const VTCell& cell : range)
+			PutCell(cell, cell.IsCluster() ? &page.GetCluster(cell.chr) : nullptr);
+		for(int i = 0; i < blanks; i++)
+			PutCell(VTCell::Void(), nullptr);
+		Flush();
+		line.Collapse(); // FetchRange() expands the packed history lines.
+		return s.IsError();
+	}, rectsel);
+	End();
+	return ok && !s.IsError();
+}
+
+bool VTExporter::Export(const Vector<VTLine>& lines, const Vector<WString>& clusters, const Rect& r, Stream& s)
+{
+	LTIMING("VTExporter::Export(snapshot)");
+
+	if(IsNull(r) || r.top < 0 || r.top > r.bottom || r.bottom >= lines.GetCount())
+		return false;
+
+	static WString sInvalid(0xFFFD, 1);
+
+	Begin(s);
+	for(int i = r.top; i <= r.bottom && !s.IsError(); i++) {
+		const VTLine& line = lines[i];
+		int length = line.GetLength();
+		int b = 0, n = length;
+		if(r.top == r.bottom || rectsel) {
+			b = r.left;
+			n = min(length, r.right - r.left);
+		}
+		else
+		if(r.top == i) {
+			b = r.left;
+			n = min(length, length - r.left);
+		}
+		else
+		if(r.bottom == i) {
+			b = 0;
+			n = min(length, r.right);
+		}
+		b = min(b, length);
+		n = clamp(n, 0, length - b);
+		PutLine(line.IsWrapped());
+		int x = 0;
+		line.Visit([&](const VTCell& cell) {
+			if(x >= b && x < b + n) {
+				int k = cell.chr & VTCell::CLUSTER_MASK;
+				PutCell(cell, !cell.IsCluster() ? nullptr
+				                                : k < clusters.GetCount() && clusters[k].GetCount()
+				                                ? &clusters[k] : &sInvalid);
+			}
+			x++;
+		});
+		Flush();
+	}
+	End();
+	return !s.IsError();
+}
+
+void VTExporter::Begin(Stream& s)
+{
+	out = &s;
+	buffer.Clear();
+	blanks.Clear();
+	rendition = VTCell();
+	span    = false;
+	first   = true;
+	wrapped = false;
+	if(format == VTEXPORT_HTML)
+		buffer.Cat("<pre class=\"vt\">");
+}
+
+void VTExporter::End()
+{
+	if(format == VTEXPORT_ANSI && (rendition.sgr || !IsNull(rendition.ink) || !IsNull(rendition.paper)))
+		buffer.Cat("\x1b[0m");
+	else
+	if(format == VTEXPORT_HTML) {
+		if(span)
+			buffer.Cat("</span>");
+		buffer.Cat("</pre>");
+	}
+	Flush();
+	out = nullptr;
+}
+
+void VTExporter::PutLine(bool w)
+{
+	// The trailing blanks of the previous line are dropped.
+	if(!first && (rectsel || !wrapped))
+		buffer.Cat(eol);
+	blanks.Clear();
+	first   = false;
+	wrapped = w;
+}
+
+void VTExporter::PutCell(const VTCell& cell, const WString *cluster)
+{
+	if((cell.chr == 0 && tspaces) || cell.IsImage()) {
+		blanks.Add(cell);
+		return;
+	}
+	if(!cluster && cell.chr < 32) // The second half of a wide character, or an unused cell.
+		return;
+	for(const VTCell& blank : blanks) {
+		SetRendition(blank);
+		PutChar(' ');
+	}
+	blanks.Clear();
+	SetRendition(cell);
+	if(cluster)
+		for(int c : *cluster)
+			PutChar(c);
+	else
+		PutChar(cell.chr);
+}
+
+void VTExporter::PutChar(dword c)
+{
+	if(format == VTEXPORT_HTML)
+		switch(c) {
+		case '&': buffer.Cat("&amp;");  return;
+		case '<': buffer.Cat("&lt;");   return;
+		case '>': buffer.Cat("&gt;");   return;
+		case '"': buffer.Cat("&quot;"); return;
+		default:  break;
+		}
+	sPutUtf8(buffer, c);
+}
+
+void VTExporter::SetRendition(const VTCell& cell)
+{
+	if(format == VTEXPORT_TEXT
+	|| ((cell.sgr & SGR_VISIBLE) == (rendition.sgr & SGR_VISIBLE)
+		&& cell.ink == rendition.ink
+		&& cell.paper == rendition.paper))
+			return;
+
+	if(format == VTEXPORT_ANSI)
+		SetAnsiRendition(cell);
+	else
+		SetHtmlRendition(cell);
+
+	rendition.sgr   = cell.sgr & SGR_VISIBLE;
+	rendition.ink   = cell.ink;
+	rendition.paper = cell.paper;
+}
+
+void VTExporter::SetAnsiRendition(const VTCell& cell)
+{
+	// Only the changes are emitted, unless an attribute is turned off.
+
+	VTCell cur = rendition;
+	String s;
+	auto Add = [&](const String& code) {
+		if(s.GetCount())
+			s.Cat(';');
+		s.Cat(code);
+	};
+
+	word sgr = cell.sgr & SGR_VISIBLE;
+	if(cur.sgr & ~sgr) {
+		Add("0");
+		cur = VTCell();
+	}
+
+	static const struct { word sgr; const char *code; } sCodes[] = {
+		{ VTCell::SGR_BOLD,      "1"  },
+		{ VTCell::SGR_FAINT,     "2"  },
+		{ VTCell::SGR_ITALIC,    "3"  },
+		{ VTCell::SGR_UNDERLINE, "4"  },
+		{ VTCell::SGR_BLINK,     "5"  },
+		{ VTCell::SGR_INVERTED,  "7"  },
+		{ VTCell::SGR_HIDDEN,    "8"  },
+		{ VTCell::SGR_STRIKEOUT, "9"  },
+		{ VTCell::SGR_OVERLINE,  "53" }
+	};
+
+	for(const auto& code : sCodes)
+		if((sgr & code.sgr) && !(cur.sgr & code.sgr))
+			Add(code.code);
+
+	auto AddColor = [&](Color c, int base) {
+		if(IsNull(c))
+			Add(AsString(base + 9));
+		else {
+			int i = c.GetSpecial();
+			if(i >= 0 && i < 8)
+				Add(AsString(base + i));
+			else
+			if(i >= 8 && i < 16)
+				Add(AsString(base + 60 + i - 8));
+			else
+			if(i >= 16)
+				Add(Format("%d;5;%d", base + 8, i));
+			else
+				Add(Format("%d;2;%d;%d;%d", base + 8, c.GetR(), c.GetG(), c.GetB()));
+		}
+	};
+
+	if(cell.ink != cur.ink)
+		AddColor(cell.ink, 30);
+	if(cell.paper != cur.paper)
+		AddColor(cell.paper, 40);
+
+	buffer << "\x1b[" << s << "m";
+}
+
+void VTExporter::SetHtmlRendition(const VTCell& cell)
+{
+	if(span) {
+		buffer.Cat("</span>");
+		span = false;
+	}
+
+	String cls, style;
+
+	// Inverted cells swap their colors. The default colors are then taken from the
+	// "vt-fgp" (paper as ink) and "vt-bgi" (ink as paper) classes.
+	bool inverted = cell.IsInverted();
+	Color ink   = inverted ? cell.paper : cell.ink;
+	Color paper = inverted ? cell.ink   : cell.paper;
+
+	auto AddColor = [&](Color c, bool fg) {
+		if(IsNull(c)) {
+			if(inverted)
+				cls << (fg ? " vt-fgp" : " vt-bgi");
+			return;
+		}
+		int i = c.GetSpecial();
+		if(i >= 0 && i < 16) {
+			cls << (fg ? " vt-fg" : " vt-bg") << i;
+			return;
+		}
+		if(i >= 16)
+			c = sCubeColor(i);
+		style << (fg ? "color:" : "background-color:") << ColorToHtml(c) << ";";
+	};
+
+	AddColor(ink, true);
+	AddColor(paper, false);
+
+	if(cell.IsBold())
+		cls << " vt-b";
+	if(cell.IsFaint())
+		cls << " vt-f";
+	if(cell.IsItalic())
+		cls << " vt-i";
+	if(cell.IsBlinking())
+		cls << " vt-k";
+	if(cell.IsConcealed())
+		cls << " vt-h";
+	String d = sDecorations(cell);
+	if(d.GetCount())
+		cls << " vt-" << d;
+
+	if(cls.IsEmpty() && style.IsEmpty())
+		return;
+
+	buffer << "<span";
+	if(cls.GetCount())
+		buffer << " class=\"" << cls.Mid(1) << "\"";
+	if(style.GetCount())
+		buffer << " style=\"" << style << "\"";
+	buffer << ">";
+	span = true;
+}
+
+void VTExporter::Flush()
+{
+	if(out && buffer.GetCount()) {
+		out->Put(buffer);
+		buffer.Clear();
+	}
+}
+
+String VTExporter::GetStyleSheet(const Color *palette, Color ink, Color paper)
+{
+	String s;
+	s << "pre.vt { color: " << ColorToHtml(ink) << "; background-color: " << ColorToHtml(paper) << "; }\n";
+	for(int i = 0; i < 16; i++)
+		s << ".vt-fg" << i << " { color: " << ColorToHtml(palette[i]) << "; }\n"
+		  << ".vt-bg" << i << " { background-color: " << ColorToHtml(palette[i]) << "; }\n";
+	s << ".vt-fgp { color: " << ColorToHtml(paper) << "; }\n"
+	  << ".vt-bgi { background-color: " << ColorToHtml(ink) << "; }\n"
+	  << ".vt-b { font-weight: bold; }\n"
+	  << ".vt-f { opacity: 0.5; }\n"
+	  << ".vt-i { font-style: italic; }\n"
+	  << ".vt-h { visibility: hidden; }\n"
+	  << ".vt-k { animation: vt-blink 1s step-end infinite; }\n"
+	  << "@keyframes vt-blink { 50% { opacity: 0; } }\n";
+
+	static const char *sDecor[] = { "u", "o", "s", "uo", "us", "os", "uos" };
+	for(const char *d : sDecor) {
+		s << ".vt-" << d << " { text-decoration-line:";
+		for(const char *p = d; *p; p++)
+			s << (*p == 'u' ? " underline" : *p == 'o' ? " overline" : " line-through");
+		s << "; }\n";
+	}
+	return s;
+}
+}
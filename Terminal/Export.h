@@ -0,0 +1,66 @@
+#ifndef _VTExport_h_
+#define _VTExport_h_
+
+#include <Core/Core.h>
+#include "Page.h"
+
+namespace Upp {
+
+enum VTExportFormat : int {
+    VTEXPORT_TEXT,
+    VTEXPORT_ANSI,
+    VTEXPORT_HTML
+};
+
+// Writes a range of lines to a stream as plain text, as text with SGR sequences (only the
+// changes of the rendition are emitted), or as HTML that uses the CSS classes defined by
+// GetStyleSheet(). The lines are written one by one, so the memory usage does not depend on
+// the size of the range. The range is interpreted as in VTPage::FetchRange(), and the wrapped
+// lines are joined as in AsWString().
+//
+// Export(const VTPage&) must be called from the thread that owns the page. The second
+// version exports a snapshot (see VTPage::GetLines() and VTPage::GetClusters()) without
+// modifying its lines, so it can be called from a worker thread.
+
+class VTExporter {
+public:
+    VTExporter();
+
+    VTExporter&     Format(int fmt)                         { format = fmt; return *this; }
+    VTExporter&     RectSelection(bool b = true)            { rectsel = b;  return *this; }
+    VTExporter&     TrailingSpaces(bool b = true)           { tspaces = b;  return *this; }
+    VTExporter&     Eol(const char *s)                      { eol = s;      return *this; }
+
+    bool            Export(const VTPage& page, const Rect& r, Stream& out);
+    bool            Export(const Vector<VTLine>& lines, const Vector<WString>& clusters, const Rect& r, Stream& out);
+
+    // Returns the CSS rules for the HTML output. 'palette' holds the 16 ANSI colors.
+    static String   GetStyleSheet(const Color *palette, Color ink, Color paper);
+
+private:
+    void            Begin(Stream& s);
+    void            End();
+    void            PutLine(bool wrapped);
+    void            PutCell(const VTCell& cell, const WString *cluster);
+    void            PutChar(dword c);
+    void            SetRendition(const VTCell& cell);
+    void            SetAnsiRendition(const VTCell& cell);
+    void            SetHtmlRendition(const VTCell& cell);
+    void            Flush();
+
+    int             format;
+    bool            rectsel;
+    bool            tspaces;
+    String          eol;
+
+    Stream         *out;
+    String          buffer;                                 // Holds a single line.
+    Vector<VTCell>  blanks;                                 // Pending blank cells.
+    VTCell          rendition;                              // The current rendition.
+    bool            span;
+    bool            first;
+    bool            wrapped;
+};
+
+}
+#endif
@@ -9,6 +9,7 @@ void TerminalCtrl::InitParser(VTInStream& vts)
 {
 	vts.Reset();
 	vts.WhenChr = [=, this](int c) { PutChar(c); };
+	vts.WhenChrs = [=, this](const dword *cps, int n) { PutChars(cps, n); };
 	vts.WhenCtl = [=, this](byte c) { ParseControlChars(c); };
 	vts.WhenEsc = [=, this](const VTInStream::Sequence& seq) { ParseEscapeSequences(seq); };
 	vts.WhenCsi = [=, this](const VTInStream::Sequence& seq) { ParseCommandSequences(seq); };
@@ -46,6 +47,7 @@ void TerminalCtrl::Reset(bool full)
 		DECcolm(false);
 		dpage.Reset();
 		apage.Reset();
+		ClearKittyImages();
 		gsets_backup.Reset();
 		cellattrs_backup = Null;
 		dpage.WhenUpdate();
@@ -112,16 +114,42 @@ void TerminalCtrl::Restore(bool tpage, bool csets, bool attrs)
 void TerminalCtrl::PutChar(int c)
 {
 	VTCell cell = cellattrs;
-	cell.chr = LookupChar(c);
+	cell.chr = IsIdentityCharset() ? c : LookupChar(c);
 	if(modes[IRM])
 		page->InsertCell(cell);
 	else
 		page->AddCell(cell);
 }
 
+void TerminalCtrl::PutChars(const dword *cps, int n)
+{
+	if(modes[IRM]) {
+		for(int i = 0; i < n; i++)
+			PutChar(cps[i]);
+		return;
+	}
+
+	if(IsIdentityCharset()) {
+		page->AddCells(cps, n, cellattrs);
+		return;
+	}
+
+	dword buf[256];
+	while(n > 0) {
+		int count = min(n, (int) __countof(buf));
+		for(int i = 0; i < count; i++)
+			buf[i] = LookupChar(cps[i]);
+		page->AddCells(buf, count, cellattrs);
+		cps += count;
+		n -= count;
+	}
+}
+
 void TerminalCtrl::Write(const void *data, int size, bool utf8)
 {
 	if(size > 0) {
+		if(recorder)
+			recorder->Output(data, size);
 		PreParse();
 		parser.Parse(data, size, utf8);
 		PostParse();
@@ -135,6 +163,8 @@ void TerminalCtrl::Flush()
 	
 	LLOG("Flush() -> " << out.GetLength() << " bytes.");
 	
+	if(recorder)
+		recorder->Input(out);
 	WhenOutput(out);
 	if(!modes[SRM]) // Local echo on/off.
 		Echo(out);
@@ -285,6 +315,15 @@ TerminalCtrl& TerminalCtrl::PutDCS(int c, int cnt)
 	return *this;
 }
 
+TerminalCtrl& TerminalCtrl::PutAPC(const String& s, int cnt)
+{
+	LLOG("PutAPC() -> " << s);
+
+	while(cnt-- > 0) { Put0(0x9F).PutRaw(s).Put0(0x9C); }
+	Flush();
+	return *this;
+}
+
 TerminalCtrl& TerminalCtrl::PutSS2(const String& s, int cnt)
 {
 	LLOG("PutSS2() -> " << s);
@@ -358,7 +397,7 @@ void TerminalCtrl::Serialize(Stream& s)
 	ColorTableSerializer cts(colortable);
 	String chrset = CharsetName(charset);
     
-	int version = 1;
+	int version = 2;
 	s / version;
 
 	if(version >= 1) {
@@ -399,6 +438,9 @@ void TerminalCtrl::Serialize(Stream& s)
 		s % dpage;
 		s % cts;
 	}
+	if(version >= 2) {
+		s % kittyimages; // File access is left out: it is up to the application only.
+	}
 
 	if(s.IsLoading()) {
 		SetCharset(CharsetByName(chrset));
@@ -437,6 +479,7 @@ void TerminalCtrl::Jsonize(JsonIO& jio)
         ("SixelGraphics",       sixelimages)
         ("JexerGraphics",       jexerimages)
         ("iTerm2Graphics",      iterm2images)
+        ("KittyGraphics",       kittyimages)
         ("Hyperlinks",          hyperlinks)
         ("ClipboardAccess",     clipaccess)
         ("DelayedRefresh",      delayedrefresh)
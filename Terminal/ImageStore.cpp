@@ -0,0 +1,179 @@
+#include "ImageStore.h"
+
+#define LLOG(x)		// RLOG("VTImageStore: " << x)
+#define LTIMING(x)	// RTIMING(x)
+
+namespace Upp {
+
+static int64 sMaxRetainedSize  = 1024 * 1024 * 4 * 128;
+static int   sMaxRetainedCount = 256000;
+
+VTImageStore::Shard& VTImageStore::GetShard(uint64 key)
+{
+	static Shard sShards[SHARDS];
+	return sShards[(key >> 59) & (SHARDS - 1)];
+}
+
+uint64 VTImageStore::Hash(const void *data, int64 len, uint64 seed)
+{
+	LTIMING("VTImageStore::Hash");
+
+	// A simple 64-bit multiply-rotate hash that consumes 8 bytes per step.
+	auto Mix = [](uint64 h, uint64 v) -> uint64 {
+		h ^= v * 0x9E3779B97F4A7C15ull;
+		h  = (h << 31) | (h >> 33);
+		return h * 0xC2B2AE3D27D4EB4Full;
+	};
+
+	const byte *s = (const byte *) data;
+	uint64 h = seed ^ (uint64) len * 0x165667B19E3779F9ull;
+	for(; len >= 8; s += 8, len -= 8)
+		h = Mix(h, Peek64le(s));
+	uint64 t = 0;
+	memcpy(&t, s, (size_t) len);
+	h = Mix(h, t);
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDull;
+	h ^= h >> 33;
+	return h;
+}
+
+void VTImageStore::Unlink(Shard& s, Entry *e)
+{
+	if(!e->next)
+		return;
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	e->prev = e->next = nullptr;
+	s.retained -= e->bytes;
+	s.count--;
+}
+
+void VTImageStore::Evict(Shard& s)
+{
+	// The limits are split evenly among the shards.
+	int64 maxsize  = sMaxRetainedSize / SHARDS;
+	int   maxcount = max(1, sMaxRetainedCount / SHARDS);
+	while(s.lru.next != &s.lru && (s.retained > maxsize || s.count > maxcount)) {
+		Entry *e = s.lru.next;
+		LLOG("Evict: " << e->key << ", " << e->bytes << " bytes");
+		Unlink(s, e);
+		s.map.UnlinkKey(e->key);
+		s.size -= e->bytes;
+		s.entries--;
+		delete e;
+	}
+}
+
+VTImageStore::Entry* VTImageStore::Acquire(uint64 key)
+{
+	Shard& s = GetShard(key);
+	Mutex::Lock __(s.lock);
+	int i = s.map.Find(key);
+	if(i < 0)
+		return nullptr;
+	Entry *e = s.map[i];
+	if(e->refs++ == 0)
+		Unlink(s, e);
+	return e;
+}
+
+VTImageStore::Entry* VTImageStore::Add(uint64 key, const Image& img, Size cellsize)
+{
+	Shard& s = GetShard(key);
+	Mutex::Lock __(s.lock);
+	int i = s.map.Find(key);
+	if(i >= 0) {
+		Entry *e = s.map[i];
+		if(e->refs++ == 0)
+			Unlink(s, e);
+		return e;
+	}
+	Entry *e = new Entry;
+	e->image    = img;
+	e->cellsize = cellsize;
+	e->key      = key;
+	e->bytes    = (int) min<int64>((int64) img.GetLength() * sizeof(RGBA), INT_MAX);
+	e->refs     = 1;
+	s.map.Put(key, e);
+	s.size += e->bytes;
+	s.entries++;
+	return e;
+}
+
+void VTImageStore::Retain(Entry *e)
+{
+	// The caller holds a reference, so the entry can't be evicted meanwhile.
+	ASSERT(e && e->refs > 0);
+	e->refs++;
+}
+
+void VTImageStore::Release(Entry *e)
+{
+	// The last reference is dropped under the lock, so the entry can't be acquired (or
+	// evicted) meanwhile.
+	if(!e)
+		return;
+	Shard& s = GetShard(e->key);
+	Mutex::Lock __(s.lock);
+	if(--e->refs == 0) {
+		e->prev = s.lru.prev;
+		e->next = &s.lru;
+		s.lru.prev->next = e;
+		s.lru.prev = e;
+		s.retained += e->bytes;
+		s.count++;
+		Evict(s);
+	}
+}
+
+void VTImageStore::SetMaxSize(int64 maxsize, int maxcount)
+{
+	sMaxRetainedSize  = max<int64>(0, maxsize);
+	sMaxRetainedCount = max(0, maxcount);
+	for(int i = 0; i < SHARDS; i++) {
+		Shard& s = GetShard((uint64) i << 59);
+		Mutex::Lock __(s.lock);
+		Evict(s);
+	}
+}
+
+void VTImageStore::Purge()
+{
+	for(int i = 0; i < SHARDS; i++) {
+		Shard& s = GetShard((uint64) i << 59);
+		Mutex::Lock __(s.lock);
+		while(s.lru.next != &s.lru) {
+			Entry *e = s.lru.next;
+			Unlink(s, e);
+			s.map.UnlinkKey(e->key);
+			s.size -= e->bytes;
+			s.entries--;
+			delete e;
+		}
+	}
+}
+
+int64 VTImageStore::GetSize()
+{
+	int64 n = 0;
+	for(int i = 0; i < SHARDS; i++) {
+		Shard& s = GetShard((uint64) i << 59);
+		Mutex::Lock __(s.lock);
+		n += s.size;
+	}
+	return n;
+}
+
+int VTImageStore::GetCount()
+{
+	int n = 0;
+	for(int i = 0; i < SHARDS; i++) {
+		Shard& s = GetShard((uint64) i << 59);
+		Mutex::Lock __(s.lock);
+		n += s.entries;
+	}
+	return n;
+}
+
+}
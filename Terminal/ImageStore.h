@@ -0,0 +1,76 @@
+#ifndef _VTImageStore_h_
+#define _VTImageStore_h_
+
+#include <Core/Core.h>
+#include <Draw/Draw.h>
+
+namespace Upp {
+
+// Process-wide store of the decoded inline images. The images are keyed by a 64-bit hash of
+// their source, and shared by the terminals that display them. Each terminal holds a single
+// reference to each image its cells refer to, so the referenced images are never evicted. The
+// images that are no longer referenced are retained, up to a size and count limit, in case
+// they are displayed again.
+//
+// The store is split into shards, each guarded by its own lock, and only adding, acquiring or
+// releasing an image takes a lock. The entries are immutable, so a terminal can read its
+// images (e.g. while painting) without locking.
+
+class VTImageStore {
+public:
+    struct Entry : NoCopy {
+        Image       image;
+        Size        cellsize;                               // The size of the image in cells.
+        uint64      key;
+        int         bytes;
+
+    private:
+        friend class VTImageStore;
+        Atomic      refs;
+        Entry      *prev;                                   // Unreferenced entries, LRU order.
+        Entry      *next;
+        Entry() : key(0), bytes(0), refs(0), prev(nullptr), next(nullptr) {}
+    };
+
+    // Returns the image with the key with a new reference, or nullptr.
+    static Entry*   Acquire(uint64 key);
+
+    // Adds the image and returns it with a new reference. If an image with the same key was
+    // added meanwhile, that image is returned instead.
+    static Entry*   Add(uint64 key, const Image& img, Size cellsize);
+
+    static void     Retain(Entry *e);
+    static void     Release(Entry *e);
+
+    // The limits apply to the unreferenced images.
+    static void     SetMaxSize(int64 maxsize, int maxcount);
+    static void     Purge();                                // Drops the unreferenced images.
+
+    static int64    GetSize();                              // Bytes, including the unreferenced images.
+    static int      GetCount();
+
+    // Hashes arbitrary data into an image key.
+    static uint64   Hash(const void *data, int64 len, uint64 seed = 0);
+    static uint64   Hash(const String& s, uint64 seed = 0)  { return Hash(~s, s.GetLength(), seed); }
+
+private:
+    enum { SHARDS = 16 };
+
+    struct Shard {
+        Mutex       lock;
+        VectorMap<uint64, Entry*> map;
+        Entry       lru;                                    // Sentinel.
+        int64       size     = 0;                           // Bytes.
+        int64       retained = 0;
+        int         entries  = 0;
+        int         count    = 0;                           // Retained entries.
+        Shard()                                             { lru.prev = lru.next = &lru; }
+    };
+
+    static Shard&   GetShard(uint64 key);
+    static void     Unlink(Shard& s, Entry *e);
+    static void     Evict(Shard& s);
+};
+
+}
+#endif
@@ -0,0 +1,603 @@
+#include "Terminal.h"
+
+#ifdef PLATFORM_POSIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+#define LLOG(x)     // RLOG("TerminalCtrl (#" << this << "]: " << x)
+#define LTIMING(x)	// RTIMING(x)
+
+namespace Upp {
+
+// For more information on kitty's terminal graphics protocol, see:
+// https://sw.kovidgoyal.net/kitty/graphics-protocol/
+//
+// Supported: Transmission (a=t, T, q) of PNG (or any format StreamRaster can decode) and raw
+// RGB/RGBA data, optionally zlib compressed, directly (chunked or not), via regular or
+// temporary files and, on POSIX systems, via shared memory objects; placements (a=p) with
+// source rectangles, cell sizes and placement ids; and deletion by image id, image number or
+// all at once (d=a, i, n). Animations, relative placements and the other deletion modes are
+// not supported.
+
+static constexpr int   KITTY_MAX_SIZE   = 10000;                // Pixels, per side.
+static constexpr int64 KITTY_MAX_AREA   = 8192 * 8192;          // Pixels.
+static constexpr int64 KITTY_MAX_DATA   = 256 * 1024 * 1024;    // Of a single transmission.
+static constexpr int64 KITTY_QUOTA      = 320 * 1024 * 1024;    // Of the stored images.
+
+static bool sIsValidSize(Size sz)
+{
+	return sz.cx > 0 && sz.cy > 0
+		&& sz.cx <= KITTY_MAX_SIZE && sz.cy <= KITTY_MAX_SIZE
+		&& (int64) sz.cx * sz.cy <= KITTY_MAX_AREA;
+}
+
+static bool sIsRegularFile(String& path)
+{
+	// Only regular files outside of the pseudo file systems are read. Anything else (e.g. a
+	// FIFO, which would block the GUI thread on open, or a device) is refused. On POSIX
+	// systems the path is resolved first, so symbolic links can't get around this.
+
+#ifdef PLATFORM_POSIX
+	char *rp = realpath(~path, nullptr);
+	if(!rp)
+		return false;
+	path = rp;
+	free(rp);
+	struct stat st;
+	if(stat(~path, &st) != 0 || !S_ISREG(st.st_mode))
+		return false;
+	for(const char *s : { "/proc/", "/sys/", "/dev/" })
+		if(path.StartsWith(s) && !path.StartsWith("/dev/shm/"))
+			return false;
+	return true;
+#else
+	FindFile ff(path);
+	return ff && ff.IsFile();
+#endif
+}
+
+static String sInflate(const void *data, int64 len, int64 limit)
+{
+	// Decompresses a zlib stream. The output is capped, so a small payload can't expand
+	// into gigabytes. Returns a void string on error, or if the output would exceed the cap.
+
+	String out;
+	int64 total = 0;
+	bool overflow = false;
+
+	Zlib z;
+	z.WhenOut = [&](const void *p, int n) {
+		total += n;
+		if(total > limit)
+			overflow = true;
+		else
+			out.Cat((const char *) p, n);
+	};
+	z.Decompress();
+	const char *s = (const char *) data;
+	for(int64 i = 0; i < len && !overflow && !z.IsError(); i += 4096)
+		z.Put(s + i, (int) min<int64>(4096, len - i));
+	if(!overflow && !z.IsError())
+		z.End();
+	return overflow || z.IsError() ? String::GetVoid() : out;
+}
+
+void TerminalCtrl::ParseApplicationProgrammingCommands(const VTInStream::Sequence& seq)
+{
+	if(kittyimages && seq.payload.StartsWith("G"))
+		ParseKittyGraphics(seq);
+	else
+		WhenApplicationCommand(seq.payload);
+}
+
+void TerminalCtrl::ParseKittyGraphics(const VTInStream::Sequence& seq)
+{
+	LTIMING("TerminalCtrl::ParseKittyGraphics");
+
+	const char *s = ~seq.payload + 1;
+	const char *e = seq.payload.End();
+	const char *q = (const char *) memchr(s, ';', e - s);
+	const char *p = q ? q + 1 : e;
+
+	KittyCommand cmd;
+	ParseKittyCommand(s, q ? q : e, cmd);
+
+	// The first chunk of a chunked transmission carries the keys, the rest only the 'm' key.
+	// The chunks are decoded as they arrive, so the whole payload is never held twice.
+	if(kittychunked) {
+		kittydatasize += e - p;
+		if(kittydatasize > KITTY_MAX_DATA) {
+			KittyReply(kittychunk, "EFBIG:Transmission is too large");
+			kittydata.Clear();
+			kittychunked = false;
+			return;
+		}
+		kittydata.Put(p, int(e - p));
+		if(cmd.more)
+			return;
+		kittychunked = false;
+		ExecuteKittyCommand(kittychunk, kittydata.GetResult());
+		return;
+	}
+
+	if(cmd.more && findarg(cmd.action, 't', 'T', 'q') >= 0) {
+		kittychunk    = cmd;
+		kittydatasize = e - p;
+		kittychunked  = true;
+		kittydata.Clear();
+		kittydata.Put(p, int(e - p));
+		return;
+	}
+
+	ExecuteKittyCommand(cmd, VTBase64Decoder::Decode(p, int(e - p)));
+}
+
+void TerminalCtrl::ParseKittyCommand(const char *s, const char *e, KittyCommand& cmd)
+{
+	// The control data is a comma separated list of key=value pairs. The keys are single
+	// characters, and the values are either single characters or integers.
+
+	while(s < e) {
+		const char *q = (const char *) memchr(s, ',', e - s);
+		if(!q)
+			q = e;
+		if(q - s >= 3 && s[1] == '=') {
+			int key = *s;
+			int chr = s[2];
+			int64 n = ScanInt64(String(s + 2, q));
+			if(IsNull(n))
+				n = 0;
+			switch(key) {
+			case 'a': cmd.action      = chr; break;
+			case 't': cmd.medium      = chr; break;
+			case 'o': cmd.compression = chr; break;
+			case 'd': cmd.deletion    = chr; break;
+			case 'f': cmd.format      = (int) n; break;
+			case 's': cmd.size.cx     = (int) clamp<int64>(n, 0, INT_MAX); break;
+			case 'v': cmd.size.cy     = (int) clamp<int64>(n, 0, INT_MAX); break;
+			case 'S': cmd.datasize    = max<int64>(n, 0); break;
+			case 'O': cmd.dataoffset  = max<int64>(n, 0); break;
+			case 'x': cmd.source.left = (int) clamp<int64>(n, 0, INT_MAX); break;
+			case 'y': cmd.source.top  = (int) clamp<int64>(n, 0, INT_MAX); break;
+			case 'w': cmd.source.right  = (int) clamp<int64>(n, 0, INT_MAX); break;
+			case 'h': cmd.source.bottom = (int) clamp<int64>(n, 0, INT_MAX); break;
+			case 'c': cmd.cells.cx    = (int) clamp<int64>(n, 0, 1000); break;
+			case 'r': cmd.cells.cy    = (int) clamp<int64>(n, 0, 1000); break;
+			case 'i': cmd.id          = (dword) n; break;
+			case 'I': cmd.number      = (dword) n; break;
+			case 'p': cmd.placement   = (dword) n; break;
+			case 'q': cmd.quiet       = (int) n; break;
+			case 'C': cmd.cursor      = (int) n; break;
+			case 'm': cmd.more        = n == 1; break;
+			default:
+				LLOG("Unhandled kitty graphics key: " << (char) key);
+				break;
+			}
+		}
+		s = q + 1;
+	}
+}
+
+void TerminalCtrl::ExecuteKittyCommand(KittyCommand& cmd, const String& payload)
+{
+	LLOG("Kitty graphics command: " << (char) cmd.action << ", id: " << cmd.id);
+
+	switch(cmd.action) {
+	case 't':
+	case 'T':
+	case 'q': {
+		String err;
+		Image img = LoadKittyImage(cmd, payload, err);
+		if(IsNull(img)) {
+			KittyReply(cmd, Nvl(err, "EBADMSG:Unable to decode image"));
+			return;
+		}
+		if(cmd.action == 'q') {
+			KittyReply(cmd, "OK");
+			return;
+		}
+		int64 serial = ++kittyserial;
+		if(cmd.id || cmd.number) {
+			if(!cmd.id) // The terminal picks the id of a numbered image.
+				for(cmd.id = (dword) serial | 0x80000000; kittystore.Find(cmd.id) >= 0; cmd.id++)
+					;
+			// A retransmitted image replaces the old one, along with its placements.
+			KittyCommand d;
+			d.deletion = 'I';
+			d.id = cmd.id;
+			DeleteKittyImages(d);
+			KittyImage& k = kittystore.Add(cmd.id);
+			k.image  = img;
+			k.number = cmd.number;
+			k.serial = serial;
+			kittybytes += img.GetLength() * sizeof(RGBA);
+			// The store is in the order of transmission, so the oldest images are at its head.
+			int n = 0;
+			while(kittybytes > KITTY_QUOTA && n < kittystore.GetCount() - 1)
+				kittybytes -= kittystore[n++].image.GetLength() * sizeof(RGBA);
+			kittystore.Remove(0, n);
+		}
+		if(cmd.action == 'T' && !PlaceKittyImage(cmd, img, serial))
+			return;
+		KittyReply(cmd, "OK");
+		break;
+	}
+	case 'p': {
+		int i = -1;
+		if(cmd.id)
+			i = kittystore.Find(cmd.id);
+		else
+		if(cmd.number) // The newest image with the number.
+			for(int j = 0; j < kittystore.GetCount(); j++)
+				if(kittystore[j].number == cmd.number && (i < 0 || kittystore[j].serial > kittystore[i].serial))
+					i = j;
+		if(i < 0) {
+			KittyReply(cmd, "ENOENT:Image not found");
+			return;
+		}
+		cmd.id = kittystore.GetKey(i);
+		if(PlaceKittyImage(cmd, kittystore[i].image, kittystore[i].serial))
+			KittyReply(cmd, "OK");
+		break;
+	}
+	case 'd':
+		DeleteKittyImages(cmd);
+		break;
+	default:
+		LLOG("Unsupported kitty graphics action: " << (char) cmd.action);
+		KittyReply(cmd, "EINVAL:Unsupported action");
+		break;
+	}
+}
+
+Image TerminalCtrl::LoadKittyImage(const KittyCommand& cmd, const String& payload, String& err)
+{
+	LTIMING("TerminalCtrl::LoadKittyImage");
+
+	if(cmd.medium == 'd')
+		return DecodeKittyImage(cmd, ~payload, payload.GetLength(), err);
+
+	// The payload is the path of a file, or the name of a shared memory object. The data is
+	// decoded straight from its mapping. These media give the client read access to the local
+	// files, so they have to be enabled separately. All the failures to read the data are
+	// reported the same way, so the replies tell as little as possible about the files.
+
+	if(!kittyfiles) {
+		err = "EPERM:Transmission medium is disabled";
+		return Null;
+	}
+
+	static const char sReadError[] = "EBADF:Unable to read data";
+
+	if(cmd.medium == 'f' || cmd.medium == 't') {
+		String path = payload;
+		if(!sIsRegularFile(path)) {
+			err = sReadError;
+			return Null;
+		}
+		FileMapping map;
+		if(!map.Open(path)) {
+			err = sReadError;
+			return Null;
+		}
+		int64 size = map.GetFileSize();
+		int64 len  = cmd.datasize ? min(cmd.datasize, size - cmd.dataoffset) : size - cmd.dataoffset;
+		Image img;
+		if(cmd.dataoffset >= size || len <= 0 || len > KITTY_MAX_DATA || !map.Map(cmd.dataoffset, (size_t) len))
+			err = sReadError;
+		else
+			img = DecodeKittyImage(cmd, map.Begin(), len, err);
+		map.Close();
+		// Temporary files are deleted, but only if they are obviously meant to be.
+		if(cmd.medium == 't'
+		&& path.Find("tty-graphics-protocol") >= 0
+		&& (path.StartsWith("/tmp/") || path.StartsWith("/dev/shm/") || path.StartsWith(GetTempPath())))
+			FileDelete(path);
+		return img;
+	}
+
+	if(cmd.medium == 's') {
+#ifdef PLATFORM_POSIX
+		int fd = shm_open(~payload, O_RDONLY | O_NONBLOCK, 0);
+		if(fd < 0) {
+			err = sReadError;
+			return Null;
+		}
+		Image img;
+		struct stat st;
+		int64 size = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? (int64) st.st_size : 0;
+		int64 len  = cmd.datasize ? min(cmd.datasize, size - cmd.dataoffset) : size - cmd.dataoffset;
+		if(size > KITTY_QUOTA || cmd.dataoffset >= size || len <= 0 || len > KITTY_MAX_DATA)
+			err = sReadError;
+		else {
+			// Only the transmitted range is mapped. The offset of a mapping has to be aligned.
+			int64 base = cmd.dataoffset - cmd.dataoffset % max<int64>(1, sysconf(_SC_PAGESIZE));
+			size_t n   = (size_t) (cmd.dataoffset - base + len);
+			void *ptr  = mmap(nullptr, n, PROT_READ, MAP_SHARED, fd, (off_t) base);
+			if(ptr == MAP_FAILED)
+				err = sReadError;
+			else {
+				img = DecodeKittyImage(cmd, (const byte *) ptr + (cmd.dataoffset - base), len, err);
+				munmap(ptr, n);
+			}
+		}
+		close(fd);
+		// The terminal owns the object once it is transmitted, i.e. read and decoded. Otherwise
+		// the object, which could be anyone's, is left alone.
+		if(!IsNull(img))
+			shm_unlink(~payload);
+		return img;
+#endif
+	}
+
+	err = "EINVAL:Unsupported transmission medium";
+	return Null;
+}
+
+Image TerminalCtrl::DecodeKittyImage(const KittyCommand& cmd, const void *data, int64 len, String& err)
+{
+	LTIMING("TerminalCtrl::DecodeKittyImage");
+
+	if(cmd.compression == 'z') {
+		// Raw pixel data can't be larger than its given size.
+		int64 limit = KITTY_MAX_DATA;
+		if(cmd.format == 24 || cmd.format == 32) {
+			if(!sIsValidSize(cmd.size)) {
+				err = "EINVAL:Invalid image size";
+				return Null;
+			}
+			limit = (int64) cmd.size.cx * cmd.size.cy * (cmd.format / 8);
+		}
+		String s = sInflate(data, len, limit);
+		if(s.IsVoid()) {
+			err = "EINVAL:Unable to decompress data";
+			return Null;
+		}
+		KittyCommand c = cmd;
+		c.compression = 0;
+		return DecodeKittyImage(c, ~s, s.GetLength(), err);
+	}
+
+	Image img;
+	if(cmd.format == 100) {
+		// The size is checked before the image is decoded.
+		MemReadStream ms(data, len);
+		One<StreamRaster> r = StreamRaster::OpenAny(ms);
+		if(!r) {
+			err = "EBADMSG:Unable to decode image";
+			return Null;
+		}
+		if(!sIsValidSize(r->GetSize())) {
+			err = "EFBIG:Image is too large";
+			return Null;
+		}
+		img = r->GetImage();
+	}
+	else
+	if(cmd.format == 24 || cmd.format == 32) {
+		Size sz = cmd.size;
+		int  bpp = cmd.format / 8;
+		if(!sIsValidSize(sz)) {
+			err = "EINVAL:Invalid image size";
+			return Null;
+		}
+		if(len < (int64) sz.cx * sz.cy * bpp) {
+			err = "ENODATA:Insufficient image data";
+			return Null;
+		}
+		ImageBuffer ib(sz);
+		const byte *s = (const byte *) data;
+		RGBA *t = ib.Begin();
+		for(RGBA *e = ib.End(); t < e; t++, s += bpp) {
+			t->r = s[0];
+			t->g = s[1];
+			t->b = s[2];
+			t->a = bpp == 4 ? s[3] : 255;
+		}
+		img = bpp == 4 ? Premultiply(Image(ib)) : Image(ib);
+	}
+	else {
+		err = "EINVAL:Unsupported format";
+		return Null;
+	}
+
+	if(IsNull(img))
+		err = "EBADMSG:Unable to decode image";
+	else
+	if(!sIsValidSize(img.GetSize())) {
+		err = "EFBIG:Image is too large";
+		img = Null;
+	}
+	return img;
+}
+
+bool TerminalCtrl::PlaceKittyImage(const KittyCommand& cmd, const Image& img, int64 serial)
+{
+	LTIMING("TerminalCtrl::PlaceKittyImage");
+
+	// The source rectangle is given as x, y, w, h, and a zero width or height means the rest
+	// of the image.
+	Size isz = img.GetSize();
+	Rect r = cmd.source;
+	r.left   = min(r.left, isz.cx);
+	r.top    = min(r.top,  isz.cy);
+	r.right  = r.right  ? min(r.left + r.right,  isz.cx) : isz.cx;
+	r.bottom = r.bottom ? min(r.top  + r.bottom, isz.cy) : isz.cy;
+	if(r.IsEmpty()) {
+		KittyReply(cmd, "EINVAL:Empty source rectangle");
+		return false;
+	}
+
+	// A placement that is given only one of the cell dimensions keeps the aspect ratio.
+	Size fsz = GetCellSize();
+	Size rsz = r.GetSize();
+	Size csz = cmd.cells;
+	if(csz.cx > 0 && csz.cy <= 0)
+		csz.cy = max(1, (csz.cx * fsz.cx * rsz.cy) / max(1, rsz.cx * fsz.cy));
+	else
+	if(csz.cy > 0 && csz.cx <= 0)
+		csz.cx = max(1, (csz.cy * fsz.cy * rsz.cx) / max(1, rsz.cy * fsz.cx));
+	else
+	if(csz.cx <= 0 || csz.cy <= 0)
+		csz = Size((rsz.cx + fsz.cx - 1) / fsz.cx, (rsz.cy + fsz.cy - 1) / fsz.cy);
+
+	// Each placement gets its own cell image id, so it can be deleted on its own.
+	uint64 pkey = ((uint64) cmd.id << 32) | (cmd.id ? cmd.placement : (dword) serial);
+	int i = kittyplacements.Find(pkey);
+	if(i >= 0) {
+		EraseImageCells({ kittyplacements[i] });
+		kittyplacements.Remove(i);
+	}
+
+	dword params[] = {
+		(dword) r.left, (dword) r.top, (dword) r.right, (dword) r.bottom,
+		(dword) csz.cx, (dword) csz.cy, (dword) fsz.cx, (dword) fsz.cy,
+		cmd.id, cmd.placement, (dword) serial, (dword)(serial >> 32)
+	};
+	uint64 key = VTImageStore::Hash(params, sizeof(params), (uint64)(uintptr_t) this);
+
+	bool found = false;
+	dword id = GetImageId(key, found);
+	if(!found) {
+		VTImageStore::Entry *e = VTImageStore::Acquire(key);
+		if(!e) {
+			Image m = r.GetSize() == isz ? img : Crop(img, r);
+			// The cell counts can be large even for a tiny source, so the target is clamped.
+			// The image is scaled to its cells on painting anyway.
+			Size tsz = min(csz * fsz, Size(KITTY_MAX_SIZE, KITTY_MAX_SIZE));
+			double f = sqrt((double) KITTY_MAX_AREA / max<int64>(1, (int64) tsz.cx * tsz.cy));
+			if(f < 1)
+				tsz = Size(max(1, int(tsz.cx * f)), max(1, int(tsz.cy * f)));
+			if((cmd.cells.cx > 0 || cmd.cells.cy > 0) && tsz != m.GetSize())
+				m = Rescale(m, tsz);
+			e = VTImageStore::Add(key, m, csz);
+		}
+		inlineimages.Add(id, e);
+	}
+	kittyplacements.Add(pkey, id);
+
+	cellattrs.Hyperlink(false);
+
+	if(cmd.cursor == 1) { // The cursor is not moved.
+		Point pt = page->GetRelPos();
+		page->AddImage(csz, id, false, true);
+		page->MoveTo(pt);
+	}
+	else
+		page->AddImage(csz, id, true);
+
+	PruneImages();
+
+	// The placements whose cells are gone are forgotten along with their images.
+	if(kittyplacements.GetCount() > 2 * max(64, inlineimages.GetCount())) {
+		Vector<int> v;
+		for(int j = 0; j < kittyplacements.GetCount(); j++)
+			if(inlineimages.Find(kittyplacements[j]) < 0)
+				v.Add(j);
+		kittyplacements.Remove(v);
+	}
+
+	RefreshDisplay();
+	return true;
+}
+
+void TerminalCtrl::DeleteKittyImages(const KittyCommand& cmd)
+{
+	// The lowercase deletion modes remove the placements only, the uppercase modes also free
+	// the stored image data.
+
+	int  d = cmd.deletion;
+	bool all = ToLower(d) == 'a';
+	dword id = cmd.id;
+
+	if(ToLower(d) == 'n') {
+		int i = -1;
+		for(int j = 0; j < kittystore.GetCount(); j++)
+			if(kittystore[j].number == cmd.number && (i < 0 || kittystore[j].serial > kittystore[i].serial))
+				i = j;
+		if(i < 0)
+			return;
+		id = kittystore.GetKey(i);
+	}
+	else
+	if(ToLower(d) != 'i' && !all) {
+		LLOG("Unsupported kitty graphics deletion mode: " << (char) d);
+		return;
+	}
+
+	if(!all && !id)
+		return;
+
+	Vector<int> v;
+	Index<dword> ids;
+	for(int i = 0; i < kittyplacements.GetCount(); i++) {
+		uint64 pkey = kittyplacements.GetKey(i);
+		if(all || ((dword)(pkey >> 32) == id && (!cmd.placement || (dword) pkey == cmd.placement))) {
+			ids.FindAdd(kittyplacements[i]);
+			v.Add(i);
+		}
+	}
+	kittyplacements.Remove(v);
+	EraseImageCells(ids);
+
+	if(IsUpper(d)) {
+		if(all) {
+			kittystore.Clear();
+			kittybytes = 0;
+		}
+		else
+		if(!cmd.placement) {
+			int i = kittystore.Find(id);
+			if(i >= 0) {
+				kittybytes -= kittystore[i].image.GetLength() * sizeof(RGBA);
+				kittystore.Remove(i);
+			}
+		}
+	}
+
+	RefreshDisplay();
+}
+
+void TerminalCtrl::EraseImageCells(const Index<dword>& ids)
+{
+	// Erases the cells of the images on both pages, including their history, so the deleted
+	// images don't linger in the scrollback.
+
+	if(ids.IsEmpty())
+		return;
+	dpage.EraseImages(ids);
+	apage.EraseImages(ids);
+}
+
+void TerminalCtrl::KittyReply(const KittyCommand& cmd, const String& msg)
+{
+	// Only the commands that refer to an image by its id or number are answered, and the
+	// answers can be suppressed by the client (q=1: OK, q=2: all).
+
+	if((!cmd.id && !cmd.number) || cmd.quiet >= 2 || (cmd.quiet == 1 && msg == "OK"))
+		return;
+
+	String s = "G";
+	if(cmd.id)
+		s << "i=" << cmd.id;
+	if(cmd.number)
+		s << (cmd.id ? "," : "") << "I=" << cmd.number;
+	if(cmd.placement)
+		s << ",p=" << cmd.placement;
+	s << ";" << msg;
+	PutAPC(s);
+}
+
+void TerminalCtrl::ClearKittyImages()
+{
+	kittystore.Clear();
+	kittybytes = 0;
+	kittyplacements.Clear();
+	kittydata.Clear();
+	kittychunked  = false;
+	kittydatasize = 0;
+}
+
+}
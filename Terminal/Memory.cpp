@@ -0,0 +1,187 @@
+#include "Terminal.h"
+
+#define LLOG(x)     // RLOG("TerminalCtrl (#" << this << "]: " << x)
+#define LTIMING(x)	// RTIMING(x)
+
+namespace Upp {
+
+// Process-wide memory budget support.
+
+static StaticMutex sMemoryLock;
+static Index<TerminalCtrl*> sTerminals;
+static int64 sMemoryBudget = 0;
+static byte  sMemoryTimer;
+
+void TerminalCtrl::AttachMemoryBudget()
+{
+	Mutex::Lock __(sMemoryLock);
+	sTerminals.FindAdd(this);
+}
+
+void TerminalCtrl::DetachMemoryBudget()
+{
+	Mutex::Lock __(sMemoryLock);
+	sTerminals.RemoveKey(this);
+}
+
+TerminalCtrl::MemoryUsage TerminalCtrl::GetMemoryUsage() const
+{
+	LTIMING("TerminalCtrl::GetMemoryUsage");
+
+	MemoryUsage m;
+	m.page    = dpage.GetPageMemoryUsage()    + apage.GetPageMemoryUsage();
+	m.history = dpage.GetHistoryMemoryUsage() + apage.GetHistoryMemoryUsage();
+
+	Index<dword> images, links;
+	dpage.GetResources(images, links);
+	apage.GetResources(images, links);
+	for(dword id : images) {
+		int i = inlineimages.Find(id);
+		if(i >= 0)
+			m.images += inlineimages[i]->bytes;
+	}
+	for(const String& png : restoredimages)
+		m.images += png.GetLength();
+	for(const KittyImage& k : kittystore)
+		m.images += k.image.GetLength() * sizeof(RGBA);
+	for(dword id : links) {
+		int i = linksizes.Find(id);
+		if(i >= 0)
+			m.links += linksizes[i];
+	}
+	return m;
+}
+
+int64 TerminalCtrl::PruneResources()
+{
+	// Releases the images and forgets the hyperlinks that are no longer referred to by the
+	// cells, and drops the undecoded images of a restored snapshot along with them. The
+	// released images are retained by the store for a while, so only the restored images
+	// count as freed here.
+
+	Index<dword> images, links;
+	dpage.GetResources(images, links);
+	apage.GetResources(images, links);
+
+	int64 freed = 0;
+	Vector<int> v;
+	for(int i = 0; i < restoredimages.GetCount(); i++)
+		if(images.Find(restoredimages.GetKey(i)) < 0) {
+			freed += restoredimages[i].GetLength();
+			v.Add(i);
+		}
+	restoredimages.Remove(v);
+
+	v.Clear();
+	for(int i = 0; i < inlineimages.GetCount(); i++)
+		if(images.Find(inlineimages.GetKey(i)) < 0) {
+			VTImageStore::Release(inlineimages[i]);
+			v.Add(i);
+		}
+	inlineimages.Remove(v);
+
+	v.Clear();
+	for(int i = 0; i < pendingimages.GetCount(); i++)
+		if(images.Find(pendingimages.GetKey(i)) < 0)
+			v.Add(i);
+	pendingimages.Remove(v); // The decoded images are then dropped.
+	imagecount = inlineimages.GetCount() + pendingimages.GetCount();
+
+	v.Clear();
+	for(int i = 0; i < linksizes.GetCount(); i++)
+		if(links.Find(linksizes.GetKey(i)) < 0)
+			v.Add(i);
+	linksizes.Remove(v);
+
+	return freed;
+}
+
+int64 TerminalCtrl::ReleaseMemory(int64 bytes, bool trim)
+{
+	GuiLock __;
+
+	LTIMING("TerminalCtrl::ReleaseMemory");
+
+	int count = dpage.GetHistoryCount();
+	int64 freed = dpage.CompressHistory() + apage.CompressHistory();
+	if(trim && freed < bytes)
+		freed += dpage.TrimHistory(bytes - freed, GetPageSize().cy);
+	if(dpage.GetHistoryCount() < count) {
+		// The selection and the matches can refer to the dropped lines.
+		ClearSelection();
+		ClearFind();
+		freed += PruneResources();
+	}
+	LLOG("ReleaseMemory(" << bytes << ", " << trim << ") -> " << freed << " bytes freed.");
+	return freed;
+}
+
+void TerminalCtrl::SetMemoryBudget(int64 bytes, int interval)
+{
+	{
+		Mutex::Lock __(sMemoryLock);
+		sMemoryBudget = max<int64>(bytes, 0);
+	}
+	if(bytes > 0)
+		SetTimeCallback(-max(interval, 100), [] { EnforceMemoryBudget(); }, &sMemoryTimer);
+	else
+		KillTimeCallback(&sMemoryTimer);
+}
+
+int64 TerminalCtrl::GetMemoryBudget()
+{
+	Mutex::Lock __(sMemoryLock);
+	return sMemoryBudget;
+}
+
+int64 TerminalCtrl::GetTotalMemoryUsage()
+{
+	GuiLock __;
+	Mutex::Lock ___(sMemoryLock);
+	int64 total = 0;
+	for(TerminalCtrl *t : sTerminals)
+		total += t->GetMemoryUsage().GetTotal();
+	return total;
+}
+
+void TerminalCtrl::EnforceMemoryBudget()
+{
+	GuiLock __;
+
+	LTIMING("TerminalCtrl::EnforceMemoryBudget");
+
+	// The terminals are GUI objects, so they can't be destroyed while the GUI lock is held.
+	Vector<TerminalCtrl*> terminals;
+	int64 budget = 0;
+	{
+		Mutex::Lock ___(sMemoryLock);
+		terminals = clone(sTerminals.GetKeys());
+		budget = sMemoryBudget;
+	}
+	if(budget <= 0)
+		return;
+
+	int64 total = 0;
+	for(TerminalCtrl *t : terminals)
+		total += t->GetMemoryUsage().GetTotal();
+	if(total <= budget)
+		return;
+
+	// The least recently viewed terminals come first. Compressing the history is lossless,
+	// so it is tried on all terminals before any lines are dropped.
+	Sort(terminals, [](const TerminalCtrl *a, const TerminalCtrl *b) {
+		return a->lastviewed < b->lastviewed;
+	});
+	for(TerminalCtrl *t : terminals) {
+		if(total <= budget)
+			return;
+		total -= t->ReleaseMemory(total - budget, false);
+	}
+	for(TerminalCtrl *t : terminals) {
+		if(total <= budget)
+			return;
+		total -= t->ReleaseMemory(total - budget, true);
+	}
+}
+
+}
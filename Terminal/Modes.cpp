@@ -11,7 +11,7 @@ void TerminalCtrl::SetMode(const VTInStream::Sequence& seq, bool enable)
 	for(const String& s : seq.parameters) {		// Multiple terminal modes can be set/reset at once.
 		int modenum = StrInt(s);
 		const CbMode *p = FindModePtr(modenum, seq.mode);
-		if(p) p->d(*this, modenum, enable);
+		if(p) p->fn(*this, modenum, enable);
 	}
 }
 
@@ -28,7 +28,7 @@ void TerminalCtrl::ReportMode(const VTInStream::Sequence& seq)
 	// 3: Permanently set
 	// 4: Permanently reset
 
-	int reply = 0, mid = p ? p->a : - 1;
+	int reply = 0, mid = p ? p->id : - 1;
 	
 	if(mid >= 0)
 		switch(mid) {
@@ -6,11 +6,102 @@
 namespace Upp {
 
 VTLine::VTLine()
-: invalid(true)
+: data(nullptr)
+, invalid(true)
 , wrapped(false)
+, clustered(false)
 {
 }
 
+VTLine::VTLine(const VTLine& src)
+: data(src.data)
+, invalid(src.invalid)
+, wrapped(src.wrapped)
+, clustered(src.clustered)
+{
+	if(data)
+		data->refs++;
+}
+
+VTLine::VTLine(VTLine&& src)
+: data(src.data)
+, invalid(src.invalid)
+, wrapped(src.wrapped)
+, clustered(src.clustered)
+{
+	src.data = nullptr;
+}
+
+VTLine::~VTLine()
+{
+	Release(data);
+}
+
+VTLine& VTLine::operator=(const VTLine& src)
+{
+	if(src.data)
+		src.data->refs++;
+	Release(data);
+	data      = src.data;
+	invalid   = src.invalid;
+	wrapped   = src.wrapped;
+	clustered = src.clustered;
+	return *this;
+}
+
+VTLine& VTLine::operator=(VTLine&& src)
+{
+	if(this != &src) {
+		Release(data);
+		data      = src.data;
+		invalid   = src.invalid;
+		wrapped   = src.wrapped;
+		clustered = src.clustered;
+		src.data  = nullptr;
+	}
+	return *this;
+}
+
+void VTLine::Release(Data *d)
+{
+	if(d && --d->refs == 0)
+		delete d;
+}
+
+void VTLine::Detach() const
+{
+	// Only the thread that owns the line (i.e. the page's thread) can detach it. Other
+	// threads hold their own copies, which keep the shared block alive but never modify it.
+
+	LTIMING("VTLine::Detach");
+
+	Data *d = new Data;
+	d->cells  = clone(data->cells);
+	d->text   = clone(data->text);
+	d->runs   = clone(data->runs);
+	d->packed = data->packed;
+	Release(data);
+	data = d;
+}
+
+Vector<VTCell>& VTLine::Cells()
+{
+	if(!data)
+		data = new Data;
+	else
+	if(data->refs > 1)
+		Detach();
+	if(data->packed)
+		Unpack();
+	return data->cells;
+}
+
+void VTLine::Clear()
+{
+	Release(data);
+	data = nullptr;
+}
+
 void VTLine::Adjust(int cx, const VTCell& filler)
 {
 	if(cx < GetCount())
@@ -21,32 +112,45 @@ void VTLine::Adjust(int cx, const VTCell& filler)
 
 void VTLine::ShiftLeft(int begin, int end, int n, const VTCell& filler)
 {
-	Insert(end, filler, n);
-	Remove(begin - 1, n);
+	// The cells are moved within the range, so the rest of the line is left untouched.
+	int w = end - begin + 1;
+	n = min(n, w);
+	if(n > 0) {
+		VTCell *p = Cells().begin() + begin - 1;
+		memmove(p, p + n, (w - n) * sizeof(VTCell));
+		VTCell::Fill(p + w - n, n, filler, VTCell::FILL_NORMAL);
+	}
 	wrapped = false;
 	invalid = true;
 }
 
 void VTLine::ShiftRight(int begin, int end, int n, const VTCell& filler)
 {
-	Insert(begin - 1, filler, n);
-	Remove(end, n);
+	int w = end - begin + 1;
+	n = min(n, w);
+	if(n > 0) {
+		VTCell *p = Cells().begin() + begin - 1;
+		memmove(p + n, p, (w - n) * sizeof(VTCell));
+		VTCell::Fill(p, n, filler, VTCell::FILL_NORMAL);
+	}
 	wrapped = false;
 	invalid = true;
 }
 
 bool VTLine::FillLeft(int begin, const VTCell& filler, dword flags)
 {
-	for(int i = 1; i <= clamp(begin, 1, GetCount()); i++)
-		At(i - 1).Fill(filler, flags);
+	int n = min(max(begin, 1), GetCount());
+	if(n > 0)
+		VTCell::Fill(Cells().begin(), n, filler, flags);
 	invalid = true;
 	return true;
 }
 
 bool VTLine::FillRight(int begin, const VTCell& filler, dword flags)
 {
-	for(int i = max(1, begin); i <= GetCount(); i++)
-		At(i - 1).Fill(filler, flags);
+	int b = max(1, begin);
+	if(b <= GetCount())
+		VTCell::Fill(Cells().begin() + b - 1, GetCount() - b + 1, filler, flags);
 	invalid = true;
 	return true;
 }
@@ -57,23 +161,266 @@ bool VTLine::Fill(int begin, int end, const VTCell& filler, dword flags)
 	int b = clamp(begin, 1, n);
 	int e = clamp(end,   1, n);
 
-	for(int i = b; i <= e; i++)
-		At(i - 1).Fill(filler, flags);
-
-	bool done = b <= e;
-	if(done)
+	bool done = n > 0 && b <= e;
+	if(done) {
+		VTCell::Fill(Cells().begin() + b - 1, e - b + 1, filler, flags);
 		invalid = true;
+	}
 	return done;
 }
 
 bool VTLine::FillLine(const VTCell& filler, dword flags)
 {
-	for(VTCell& l : static_cast<Vector<VTCell>&>(*this))
-		l.Fill(filler, flags);
+	if(!IsEmpty())
+		VTCell::Fill(Cells().begin(), GetCount(), filler, flags);
 	invalid = true;
 	return true;
 }
 
+static bool sSameAttrs(const VTCell& a, const VTCell& b)
+{
+	return a.data  == b.data
+		&& a.attrs == b.attrs
+		&& a.sgr   == b.sgr
+		&& a.ink   == b.ink
+		&& a.paper == b.paper;
+}
+
+void VTLine::TrimBlanks()
+{
+	// Trailing blanks in the default style are not stored, as missing cells read as blanks.
+	// A blank line thus owns no buffer at all. Wrapped lines are left as they are.
+
+	if(wrapped || IsPacked())
+		return;
+
+	int n = GetCount();
+	while(n > 0 && (*this)[n - 1].IsNullInstance())
+		n--;
+	if(n == 0)
+		Clear();
+	else
+	if(n < GetCount()) {
+		Vector<VTCell>& cells = Cells();
+		cells.Trim(n);
+		cells.Shrink();
+	}
+}
+
+void VTLine::Pack()
+{
+	if(IsPacked() || IsEmpty())
+		return;
+
+	LTIMING("VTLine::Pack");
+
+	if(data->refs > 1)
+		Detach();
+
+	Data& d = *data;
+	int n = d.cells.GetCount();
+	d.text.SetCount(n);
+	for(int i = 0; i < n; i++) {
+		const VTCell& cell = d.cells[i];
+		d.text[i] = cell.chr;
+		if(i == 0 || !sSameAttrs(cell, d.runs.Top().attrs)) {
+			Run& r = d.runs.Add();
+			r.begin = i;
+			r.attrs = cell;
+			r.attrs.chr = 0;
+		}
+	}
+	d.runs.Shrink();
+	d.cells.Clear();
+	d.packed = true;
+}
+
+void VTLine::Unpack()
+{
+	if(IsPacked()) {
+		Expand();
+		data->text.Clear();
+		data->runs.Clear();
+		data->packed = false;
+	}
+}
+
+void VTLine::Expand() const
+{
+	if(!IsCollapsed())
+		return;
+
+	LTIMING("VTLine::Expand");
+
+	// Packed lines are not edited, so their cells merely cache the packed data. The cache of
+	// a shared block is not filled in place, as its other owners may be reading it.
+	if(data->refs > 1)
+		Detach();
+
+	Data& d = *data;
+	int n = d.text.GetCount();
+	d.cells.SetCount(n);
+	for(int i = 0; i < d.runs.GetCount(); i++) {
+		int b = d.runs[i].begin;
+		int e = i + 1 < d.runs.GetCount() ? d.runs[i + 1].begin : n;
+		for(int j = b; j < e; j++) {
+			VTCell& cell = d.cells[j];
+			cell = d.runs[i].attrs;
+			cell.chr = d.text[j];
+		}
+	}
+}
+
+void VTLine::Collapse() const
+{
+	if(IsPacked() && data->refs == 1)
+		data->cells.Clear();
+}
+
+int64 VTLine::GetMemoryUsage() const
+{
+	if(!data)
+		return 0;
+	const Data& d = *data;
+	int64 n = sizeof(Data)
+	        + (int64) d.cells.GetAlloc() * sizeof(VTCell)
+	        + (int64) d.text.GetAlloc()  * sizeof(dword)
+	        + (int64) d.runs.GetAlloc()  * sizeof(Run);
+	return n / max(1, (int) d.refs);
+}
+
+void VTLine::GetResources(Index<dword>& images, Index<dword>& links) const
+{
+	if(!IsCollapsed()) {
+		for(const VTCell& cell : *this)
+			if(cell.IsImage())
+				images.FindAdd(cell.chr);
+			else
+			if(cell.IsHyperlink())
+				links.FindAdd(cell.data);
+		return;
+	}
+
+	// Only the runs need to be checked here. The image ids are stored in the text.
+	const Data& d = *data;
+	for(int i = 0; i < d.runs.GetCount(); i++) {
+		const VTCell& attrs = d.runs[i].attrs;
+		if(attrs.IsImage()) {
+			int e = i + 1 < d.runs.GetCount() ? d.runs[i + 1].begin : d.text.GetCount();
+			for(int j = d.runs[i].begin; j < e; j++)
+				images.FindAdd(d.text[j]);
+		}
+		else
+		if(attrs.IsHyperlink())
+			links.FindAdd(attrs.data);
+	}
+}
+
+void VTLine::Save(Stream& s) const
+{
+	// The code points are written as a raw array, so that loading a line takes little
+	// more than a copy. The lines that are not packed are packed on the fly.
+
+	byte flags = (wrapped ? 1 : 0) | (clustered ? 2 : 0);
+	int n = GetLength();
+	s % flags;
+	s / n;
+	if(n == 0)
+		return;
+
+	Buffer<dword> buffer;
+	const dword *text = nullptr;
+	Vector<Run> tmp;
+	const Vector<Run> *runs = nullptr;
+	if(IsPacked()) {
+		text = data->text.begin();
+		runs = &data->runs;
+	}
+	else {
+		buffer.Alloc(n);
+		for(int i = 0; i < n; i++) {
+			const VTCell& cell = data->cells[i];
+			buffer[i] = cell.chr;
+			if(i == 0 || !sSameAttrs(cell, tmp.Top().attrs)) {
+				Run& r = tmp.Add();
+				r.begin = i;
+				r.attrs = cell;
+			}
+		}
+		text = buffer;
+		runs = &tmp;
+	}
+
+	s.Put(text, n * sizeof(dword));
+	int count = runs->GetCount();
+	s / count;
+	int prev = 0;
+	for(const Run& r : *runs) {
+		int delta = r.begin - prev;
+		VTCell a = r.attrs;
+		s / delta;
+		s % a.data % a.attrs % a.sgr % a.ink % a.paper;
+		prev = r.begin;
+	}
+}
+
+bool VTLine::Load(Stream& s)
+{
+	Clear();
+
+	byte flags = 0;
+	int n = 0;
+	s % flags;
+	s / n;
+	wrapped   = flags & 1;
+	clustered = flags & 2;
+	invalid   = true;
+	if(n < 0 || n > s.GetLeft() / (int) sizeof(dword) || s.IsError()) {
+		s.LoadError();
+		return false;
+	}
+	if(n == 0)
+		return true;
+
+	data = new Data;
+	Data& d = *data;
+	d.packed = true;
+	d.text.SetCount(n);
+	if(!s.GetAll(d.text.begin(), n * sizeof(dword))) {
+		Clear();
+		s.LoadError();
+		return false;
+	}
+	int count = 0;
+	s / count;
+	if(count <= 0 || count > n) {
+		Clear();
+		s.LoadError();
+		return false;
+	}
+	d.runs.SetCount(count);
+	int prev = 0;
+	for(Run& r : d.runs) {
+		int delta = 0;
+		s / delta;
+		r.begin = prev + delta;
+		r.attrs.chr = 0;
+		s % r.attrs.data % r.attrs.attrs % r.attrs.sgr % r.attrs.ink % r.attrs.paper;
+		if(delta < 0 || r.begin >= n || (&r != d.runs.begin() && delta == 0)) {
+			Clear();
+			s.LoadError();
+			return false;
+		}
+		prev = r.begin;
+	}
+	if(d.runs[0].begin != 0) {
+		Clear();
+		s.LoadError();
+		return false;
+	}
+	return !s.IsError();
+}
+
 const VTLine& VTLine::Void()
 {
 	static VTLine line;
@@ -87,10 +434,10 @@ String VTLine::ToString() const
 
 WString VTLine::ToWString() const
 {
-	return AsWString(SubRange(Begin(), End()));
+	return AsWString(SubRange(begin(), end()));
 }
 
-WString AsWString(VTLine::ConstRange& cellrange, bool tspaces)
+WString AsWString(VTLine::ConstRange& cellrange, bool tspaces, const VTPage *page)
 {
 	WString txt;
 	int j = 0;
@@ -102,6 +449,9 @@ WString AsWString(VTLine::ConstRange& cellrange, bool tspaces)
 				txt.Cat(' ', j);
 				j = 0;
 			}
+			if(cell.chr & VTCell::CLUSTER)
+				txt.Cat(page ? page->GetCluster(cell.chr) : WString(0xFFFD, 1));
+			else
 			if(cell.chr >= 32)
 				txt.Cat(cell.chr, 1);
 		}
@@ -113,10 +463,19 @@ VTPage::VTPage()
 : tabsize(8)
 , autowrap(false)
 , reversewrap(false)
+, reflow(false)
 , history(false)
 , historysize(1024)
 , size(2, 2)
 , margins(Null)
+, clustersweep(1024)
+, joining(false)
+, packhistory(true)
+, expanded(0)
+, indexhistory(true)
+, indexstale(false)
+, dropped(0)
+, historygen(0)
 {
 	Reset();
 }
@@ -133,6 +492,7 @@ VTPage& VTPage::Reset()
 	Displaced(false);
 	ErasePage();
 	EraseHistory();
+	ClearClusters();
 	MoveTopLeft();
 	return *this;
 }
@@ -205,8 +565,18 @@ VTPage& VTPage::History(bool b)
 
 void VTPage::EraseHistory()
 {
+	historygen++;
+	dropped += GetHistoryCount();
+	searchindex.Clear();
+	for(const VTLine& line : stale)
+		ReleaseClusters(line);
+	for(const VTLine& line : saved)
+		ReleaseClusters(line);
+	stale.Clear();
+	stale.Shrink();
 	saved.Clear();
 	saved.Shrink();
+	expanded = 0;
 	lines.Shrink();
 	WhenUpdate();
 }
@@ -221,39 +591,318 @@ void VTPage::SetHistorySize(int sz)
 
 void VTPage::AdjustHistorySize()
 {
-	int count = saved.GetCount();
+	int count = GetHistoryCount();
 	if(count > historysize) {
-		saved.DropHead(count - historysize);
-		LLOG("AdjustHistorySize() -> Before: " << count << ", after: " << saved.GetCount());
+		DropHistory(count - historysize);
+		LLOG("AdjustHistorySize() -> Before: " << count << ", after: " << GetHistoryCount());
 	}
 }
 
+void VTPage::DropHistory(int n)
+{
+	// The stale lines are the oldest ones.
+	n = min(n, GetHistoryCount());
+	if(n <= 0)
+		return;
+	int m = min(n, stale.GetCount());
+	for(int i = 0; i < m; i++)
+		ReleaseClusters(stale[i]);
+	stale.DropHead(m);
+	for(int i = 0; i < n - m; i++)
+		ReleaseClusters(saved[i]);
+	saved.DropHead(n - m);
+	searchindex.DropHead(min(n, searchindex.GetCount()));
+	dropped += n;
+}
+
 bool VTPage::SaveToHistory(int pos)
 {
 	if(margins != GetView())
 		return false;
 	AdjustHistorySize();
 	saved.AddTail(pick(lines[pos - 1]));
+	ArchiveTail();
+	if(expanded > max(256, 4 * size.cy))
+		CollapseHistory();
 	return true;
 }
 
+void VTPage::ArchiveLine(VTLine& line, int pos, const VTLine *prev)
+{
+	// 'pos' is the line's position in the history, 'prev' is the line that precedes it.
+	line.TrimBlanks();
+	IndexLine(pos, line, prev);
+	if(packhistory)
+		line.Pack();
+}
+
+void VTPage::ArchiveTail()
+{
+	int n = GetHistoryCount();
+	ArchiveLine(saved.Tail(), n - 1, n > 1 ? &GetHistoryLine(n - 2) : nullptr);
+}
+
+void VTPage::CollapseHistory()
+{
+	// Drops the cells that were materialized for reading (e.g. painting the scrollback).
+
+	LTIMING("VTPage::CollapseHistory");
+
+	for(const VTLine& line : stale)
+		line.Collapse();
+	for(const VTLine& line : saved)
+		line.Collapse();
+	expanded = 0;
+}
+
 void VTPage::UnwindHistory(const Size& prevsize)
 {
-	int delta =  min(size.cy - prevsize.cy, saved.GetCount());
-	while(delta-- > 0) {
-		lines.Insert(0, pick(saved.Tail()));
-		saved.DropTail();
-		cursor.y++;
+	// The lines are moved in one go, as inserting them one by one at the top is quadratic.
+
+	int delta = min(size.cy - prevsize.cy, GetHistoryCount());
+	if(delta <= 0)
+		return;
+	historygen++;
+	lines.InsertN(0, delta);
+	searchindex.DropTail(delta);
+	for(int i = delta - 1; i >= 0; i--) {
+		bool old = saved.IsEmpty();
+		Saved& h = old ? stale : saved;
+		VTLine& line = lines[i];
+		line = pick(h.Tail());
+		h.DropTail();
+		line.Unpack();
+		// The stale lines are wrapped to a previous width, so the wider ones are cut to fit.
+		if(line.GetCount() < size.cx || (old && line.GetCount() > size.cx))
+			line.Adjust(size.cx, VTCell());
 	}
+	cursor.y += delta;
 }
 
 void VTPage::RewindHistory(const Size& prevsize)
 {
 	int delta = min(cursor.y - size.cy, lines.GetCount());
-	while(delta-- > 0) {
-		saved.AddTail(pick(lines[0]));
-		lines.Remove(0, 1);
+	if(delta <= 0)
+		return;
+	for(int i = 0; i < delta; i++) {
+		saved.AddTail(pick(lines[i]));
+		ArchiveTail();
+	}
+	lines.Remove(0, delta);
+}
+
+void VTPage::RewrapLine(const VTLine *src, int n, Vector<VTLine>& out, int pos, Point *pt) const
+{
+	// Rewraps a logical line, given as a run of physical lines, to the page width. If 'pos' is
+	// not negative, it is a cell offset in the logical line, and 'pt' receives the (0-based)
+	// column and row it is mapped to. The trailing blanks of the logical line are dropped.
+
+	int cx = size.cx;
+	int base = out.GetCount();
+	bool clustered = false;
+	bool images = false;
+	int tail = 0;
+
+	for(int i = 0; i < n; i++) {
+		const VTLine& line = src[i];
+		line.Expand();
+		clustered |= line.HasClusters();
+		for(const VTCell& cell : line)
+			if(cell.IsImage()) {
+				images = true;
+				break;
+			}
+	}
+
+	if(images) {
+		// Inline images span several lines and can't be rewrapped.
+		int offset = 0;
+		for(int i = 0; i < n; i++) {
+			int m = src[i].GetCount();
+			if(pt && pos >= offset && (pos < offset + m || i == n - 1))
+				*pt = Point(min(pos - offset, cx - 1), base + i);
+			out.Add(src[i]);
+			offset += m;
+		}
+		return;
+	}
+
+	const VTLine& last = src[n - 1];
+	tail = last.GetCount();
+	while(tail > 0 && last[tail - 1].IsNullInstance())
+		tail--;
+
+	VTLine *row = &out.Add();
+	int col = 0;
+	int k = 0;
+
+	for(int i = 0; i < n; i++) {
+		const VTLine& line = src[i];
+		int m = i < n - 1 ? line.GetCount() : tail;
+		for(int j = 0; j < m; j++, k++) {
+			const VTCell& cell = line[j];
+			if(col >= cx || (col == cx - 1 && cx > 1 && cell.GetWidth() == 2)) {
+				row->Wrap();
+				row->Clustered(clustered);
+				row = &out.Add();
+				col = 0;
+			}
+			if(k == pos && pt)
+				*pt = Point(col, out.GetCount() - 1);
+			row->At(col++) = cell;
+		}
+	}
+
+	row->Wrap(last.IsWrapped());
+	row->Clustered(clustered);
+
+	if(pt && pos >= k) {
+		// The position is beyond the text, in the blank part of the line.
+		int x = col + pos - k;
+		while(x >= cx) {
+			out.Add();
+			x -= cx;
+		}
+		*pt = Point(x, out.GetCount() - 1);
+	}
+}
+
+void VTPage::PullStaleLine(Vector<VTLine>& src)
+{
+	// Moves the last logical line of the stale history to 'src'. Very long logical lines
+	// are pulled in parts.
+
+	int count = stale.GetCount();
+	int limit = max(1024, 4 * size.cy);
+	int i = count - 1;
+	while(i > 0 && count - i < limit && stale[i - 1].IsWrapped())
+		i--;
+	for(int j = i; j < count; j++)
+		src.Add(pick(stale[j]));
+	stale.DropTail(count - i);
+	searchindex.Remove(i, count - i);
+}
+
+void VTPage::ReflowPage(const Size& prevsize)
+{
+	LTIMING("VTPage::ReflowPage");
+
+	// The whole history now predates the width change. The lines that are already in the
+	// stale part are kept, so the cost of a resize is proportional to what has been viewed.
+
+	historygen++;
+
+	if(stale.IsEmpty())
+		stale = pick(saved);
+	else
+		while(!saved.IsEmpty()) {
+			stale.AddTail(pick(saved.Head()));
+			saved.DropHead();
+		}
+	saved.Clear();
+
+	// The first logical line of the page can begin in the history.
+	int count = stale.GetCount();
+	int limit = max(1024, 4 * size.cy);
+	int p = 0;
+	while(p < count && p < limit && stale[count - p - 1].IsWrapped())
+		p++;
+
+	Vector<VTLine> src;
+	src.Reserve(p + lines.GetCount());
+	for(int i = count - p; i < count; i++)
+		src.Add(pick(stale[i]));
+	stale.DropTail(p);
+	searchindex.Remove(count - p, p);
+	src.AppendPick(pick(lines));
+
+	int cy = p + cursor.y - 1;
+	int cx = cursor.x - 1;
+
+	// The blank lines below the cursor are not worth keeping.
+	auto IsBlank = [](const VTLine& line) {
+		for(const VTCell& cell : line)
+			if(!cell.IsNullInstance())
+				return false;
+		return true;
+	};
+	while(src.GetCount() > cy + 1 && !src[src.GetCount() - 2].IsWrapped() && IsBlank(src.Top()))
+		src.Drop();
+
+	Vector<VTLine> rows;
+	Point pt(0, 0);
+	for(int i = 0; i < src.GetCount();) {
+		int j = i;
+		while(j < src.GetCount() - 1 && src[j].IsWrapped())
+			j++;
+		if(i <= cy && cy <= j) {
+			int pos = cx;
+			for(int k = i; k < cy; k++)
+				pos += src[k].GetLength(); // The lines pulled from the history can be collapsed.
+			RewrapLine(&src[i], j - i + 1, rows, pos, &pt);
+		}
+		else
+			RewrapLine(&src[i], j - i + 1, rows);
+		i = j + 1;
+	}
+	src.Clear();
+
+	// Any room left on the page is filled from the history.
+	while(rows.GetCount() < size.cy && !stale.IsEmpty()) {
+		Vector<VTLine> v, w;
+		PullStaleLine(v);
+		RewrapLine(v.begin(), v.GetCount(), w);
+		pt.y += w.GetCount();
+		rows.InsertPick(0, pick(w));
+	}
+
+	// The rows that don't fit on the page go to the history, so no text is lost. The cursor
+	// stays on its row, unless there is more than a page of text below it.
+	int top = max(rows.GetCount() - size.cy, 0);
+	for(int i = 0; i < top; i++) {
+		if(history) {
+			saved.AddTail(pick(rows[i]));
+			ArchiveTail();
+		}
+		else
+			ReleaseClusters(rows[i]);
+	}
+
+	lines.SetCount(size.cy);
+	for(int i = 0; i < size.cy; i++)
+		lines[i] = top + i < rows.GetCount() ? pick(rows[top + i]) : VTLine();
+
+	cursor.y = max(pt.y - top, 0) + 1;
+	cursor.x = pt.x + 1 + (cursor.eol && pt.x < size.cx - 1);
+	ClearEol();
+	AdjustHistorySize();
+}
+
+bool VTPage::RewrapHistory(int n)
+{
+	// Rewraps the end of the stale history until (at least) the last n lines of the page,
+	// history included, are in the current width. Returns true if the line count changed.
+
+	if(stale.IsEmpty() || GetLineCount() - stale.GetCount() >= n)
+		return false;
+
+	LTIMING("VTPage::RewrapHistory");
+
+	historygen++;
+	Vector<VTLine> src, rows;
+	while(!stale.IsEmpty() && GetLineCount() - stale.GetCount() < n) {
+		src.Clear();
+		rows.Clear();
+		PullStaleLine(src);
+		RewrapLine(src.begin(), src.GetCount(), rows);
+		int pos = stale.GetCount();
+		for(int i = rows.GetCount() - 1; i >= 0; i--) {
+			saved.AddHead(pick(rows[i]));
+			ArchiveLine(saved.Head(), pos, i ? &rows[i - 1] : pos ? &stale.Tail() : nullptr);
+		}
 	}
+	AdjustHistorySize();
+	return true;
 }
 
 VTPage& VTPage::SetSize(Size sz)
@@ -264,6 +913,9 @@ VTPage& VTPage::SetSize(Size sz)
 		ResetMargins();
 	if(lines.IsEmpty())
 		cursor.Clear();
+	if(reflow && oldsize.cx != size.cx && !lines.IsEmpty())
+		ReflowPage(oldsize);
+	else
 	if(HasHistory()) {
 		if(oldsize.cy < size.cy)
 			UnwindHistory(oldsize);
@@ -286,7 +938,7 @@ VTPage& VTPage::SetSize(Size sz)
 Point VTPage::GetPos() const
 {
 	Point pt(cursor);
-	pt.y += saved.GetCount();
+	pt.y += GetHistoryCount();
 
 	LLOG("GetPos() -> " << pt);
 	return pt;
@@ -354,7 +1006,7 @@ const VTCell& VTPage::GetCell(int x, int y) const
 
 int VTPage::CellAdd(const VTCell& cell, int width)
 {
-	if(width <= 0)
+	if((IsJoining(cell, width) && CellJoin(cell, width)) || width <= 0)
 		return cursor.x;
 
 	if(autowrap && cursor.eol)
@@ -382,11 +1034,60 @@ int VTPage::CellAdd(const VTCell& cell, int width)
 	return next;
 }
 
+VTPage& VTPage::AddCells(const dword *cps, int n, const VTCell& attrs)
+{
+	// Runs of narrow characters are copied to the line in one go, up to the right margin.
+	// Anything else (wide or zero-width characters, clusters, pending wraps without
+	// autowrap, or a cursor beyond the right margin) goes through CellAdd().
+
+	LTIMING("VTPage::AddCells");
+
+	VTCell cell = attrs;
+
+	auto IsNarrow = [](dword c) {
+		return c < 0x7F || (VTCell::GetCharWidth(c) == 1 && c - 0x1F1E6 >= 26);
+	};
+
+	for(int i = 0; i < n;) {
+		if(autowrap && cursor.eol) {
+			lines[cursor.y - 1].Wrap();
+			NewLine();
+		}
+		int room = margins.right - cursor.x + 1;
+		if(cursor.eol || room <= 0 || joining || !IsNarrow(cps[i])) {
+			cell.chr = cps[i++];
+			CellAdd(cell, cell.GetWidth());
+			continue;
+		}
+		int count = 1;
+		while(count < room && i + count < n && IsNarrow(cps[i + count]))
+			count++;
+		VTLine& line = lines[cursor.y - 1];
+		VTCell *p = line.begin() + cursor.x - 1;
+		for(int j = 0; j < count; j++, p++) {
+			*p = cell;
+			p->chr = cps[i + j];
+		}
+		line.Invalidate();
+		i += count;
+		if(count < room)
+			MoveRight(count);
+		else {
+			if(count > 1)
+				MoveRight(count - 1);
+			SetEol();
+		}
+	}
+	return *this;
+}
+
 VTPage& VTPage::InsertCell(const VTCell& cell)
 {
 	LLOG("InsertCell()");
 
 	int width = cell.GetWidth();
+	if(IsJoining(cell, width) && CellJoin(cell, width))
+		return *this;
 	if(width > 0) InsertCells(cursor.x, width);
 	CellAdd(cell, width);
 	return *this;
@@ -397,11 +1098,292 @@ VTPage& VTPage::RepeatCell(int n)
 	LLOG("RepeatCell(" << n << ")");
 
 	const VTCell& cell = GetCell(cursor.x - 1, cursor.y);
-	for(int i = 0, w = cell.GetWidth(); i < n; i++)
+	bool cluster = cell.IsCluster();
+	for(int i = 0, w = cell.GetWidth(); i < n; i++) {
 		CellAdd(cell, w);
+		if(cluster) {
+			RetainCluster(cell.chr);
+			lines[cursor.y - 1].Clustered();
+		}
+	}
 	return *this;
 }
 
+bool VTPage::CellJoin(const VTCell& cell, int width)
+{
+	// Zero-width code points (combining marks, variation selectors, ZWJ), the code point
+	// that follows a ZWJ, and the second half of a regional indicator pair (flags) are
+	// joined to the previously written cell, which then refers to a grapheme cluster.
+
+	bool zwj = joining;
+	joining = false;
+
+	if(cell.IsImage())
+		return false;
+
+	int x = cursor.eol ? cursor.x : cursor.x - 1;
+	if(x < 1)
+		return false;
+
+	VTLine& line = lines[cursor.y - 1];
+	VTCell *prev = &line[x - 1];
+	if(prev->chr == 1 && x > 1) // Second half of a double-width character.
+		prev = &line[x - 2];
+
+	if(prev->chr < 0x20 || prev->IsImage())
+		return false;
+
+	if(width > 0 && !zwj && prev->chr - 0x1F1E6 >= 26)
+		return false;
+
+	WString s;
+	bool wide;
+	if(prev->chr & VTCell::CLUSTER) {
+		s = GetCluster(prev->chr);
+		if(s.GetCount() >= 32) // Excess combining marks are dropped.
+			return true;
+		wide = prev->chr & VTCell::CLUSTER_WIDE;
+		ReleaseCluster(prev->chr);
+	}
+	else {
+		s.Cat(prev->chr, 1);
+		wide = VTCell::GetCharWidth(prev->chr) == 2;
+	}
+	s.Cat(cell.chr, 1);
+
+	prev->chr = AddCluster(s, wide);
+	line.Clustered();
+	line.Invalidate();
+	joining = cell.chr == 0x200D;
+	return true;
+}
+
+dword VTPage::AddCluster(const WString& s, bool wide)
+{
+	int i = clusters.Find(s);
+	if(i < 0) {
+		if(!clusters.HasUnlinked() && clusters.GetCount() >= clustersweep)
+			SweepClusters();
+		i = clusters.Put(s);
+		clusterrefs.At(i) = 0;
+	}
+	clusterrefs[i]++;
+	return VTCell::CLUSTER | (wide ? VTCell::CLUSTER_WIDE : 0) | i;
+}
+
+const WString& VTPage::GetCluster(dword chr) const
+{
+	static WString sInvalid(0xFFFD, 1);
+	int i = chr & VTCell::CLUSTER_MASK;
+	return i < clusters.GetCount() && !clusters.IsUnlinked(i) ? clusters[i] : sInvalid;
+}
+
+int64 VTPage::GetPageMemoryUsage() const
+{
+	LTIMING("VTPage::GetPageMemoryUsage");
+
+	int64 n = (int64) lines.GetAlloc() * sizeof(VTLine)
+	        + (int64) clusterrefs.GetAlloc() * sizeof(int)
+	        + (int64) indextext.GetAlloc() * sizeof(dword);
+	for(const VTLine& line : lines)
+		n += line.GetMemoryUsage();
+	for(int i = 0; i < clusters.GetCount(); i++)
+		n += sizeof(WString) + (clusters.IsUnlinked(i) ? 0 : clusters[i].GetAlloc() * sizeof(wchar));
+	return n;
+}
+
+int64 VTPage::GetHistoryMemoryUsage() const
+{
+	LTIMING("VTPage::GetHistoryMemoryUsage");
+
+	int64 n = (int64) (stale.GetAlloc() + saved.GetAlloc()) * sizeof(VTLine) + searchindex.GetMemoryUsage();
+	for(const VTLine& line : stale)
+		n += line.GetMemoryUsage();
+	for(const VTLine& line : saved)
+		n += line.GetMemoryUsage();
+	return n;
+}
+
+void VTPage::GetResources(Index<dword>& images, Index<dword>& links, bool withhistory) const
+{
+	if(withhistory) {
+		for(const VTLine& line : stale)
+			line.GetResources(images, links);
+		for(const VTLine& line : saved)
+			line.GetResources(images, links);
+	}
+	for(const VTLine& line : lines)
+		line.GetResources(images, links);
+}
+
+void VTPage::EraseImages(const Index<dword>& ids)
+{
+	LTIMING("VTPage::EraseImages");
+
+	// Only the lines that refer to the images are edited, i.e. detached and unpacked. The
+	// history lines are archived again afterwards.
+
+	auto Erase = [&](VTLine& line) {
+		bool found = false;
+		line.Visit([&](const VTCell& cell) {
+			if(cell.IsImage() && ids.Find(cell.chr) >= 0)
+				found = true;
+		});
+		if(found) {
+			for(VTCell& cell : line)
+				if(cell.IsImage() && ids.Find(cell.chr) >= 0)
+					cell = VTCell();
+			line.Invalidate();
+		}
+		return found;
+	};
+
+	bool changed = false;
+	for(Saved *h : { &stale, &saved })
+		for(VTLine& line : *h)
+			if(Erase(line)) {
+				line.TrimBlanks();
+				if(packhistory)
+					line.Pack();
+				changed = true;
+			}
+	if(changed)
+		historygen++; // The stored snapshots of the history are outdated.
+	for(VTLine& line : lines)
+		Erase(line);
+	WhenUpdate();
+}
+
+int64 VTPage::CompressHistory()
+{
+	LTIMING("VTPage::CompressHistory");
+
+	// The shared lines are left as they are: packing them would detach, i.e. duplicate, them.
+	int64 before = GetHistoryMemoryUsage();
+	auto Compress = [](Saved& h) {
+		for(VTLine& line : h)
+			if(!line.IsShared()) {
+				line.Pack();
+				line.Collapse();
+			}
+		h.Shrink();
+	};
+	Compress(stale);
+	Compress(saved);
+	expanded = 0;
+	return max<int64>(before - GetHistoryMemoryUsage(), 0);
+}
+
+int64 VTPage::TrimHistory(int64 bytes, int keep)
+{
+	LTIMING("VTPage::TrimHistory");
+
+	int count = GetHistoryCount();
+	int n = 0;
+	int64 freed = 0;
+	while(n < count - keep && freed < bytes)
+		freed += GetHistoryLine(n++).GetMemoryUsage();
+	if(n > 0) {
+		DropHistory(n);
+		stale.Shrink();
+		saved.Shrink();
+		LLOG("TrimHistory() -> " << n << " lines, " << freed << " bytes freed.");
+		WhenUpdate();
+	}
+	return freed;
+}
+
+Vector<WString> VTPage::GetClusters() const
+{
+	// A copy of the cluster table, indexed by (chr & CLUSTER_MASK), for the worker threads.
+	Vector<WString> v;
+	v.SetCount(clusters.GetCount());
+	for(int i = 0; i < clusters.GetCount(); i++)
+		if(!clusters.IsUnlinked(i))
+			v[i] = clusters[i];
+	return v;
+}
+
+void VTPage::RetainCluster(dword chr, int n)
+{
+	int i = chr & VTCell::CLUSTER_MASK;
+	if(i < clusterrefs.GetCount())
+		clusterrefs[i] += n;
+}
+
+void VTPage::ReleaseCluster(dword chr)
+{
+	int i = chr & VTCell::CLUSTER_MASK;
+	if(i < clusterrefs.GetCount() && clusterrefs[i] > 0 && --clusterrefs[i] == 0)
+		clusters.Unlink(i);
+}
+
+void VTPage::ReleaseClusters(const VTLine& line)
+{
+	if(!line.HasClusters())
+		return;
+	line.Expand();
+	for(int i = 0; i < line.GetCount(); i++)
+		if(line[i].IsCluster())
+			ReleaseCluster(line[i].chr);
+	line.Clustered(false);
+}
+
+void VTPage::SweepClusters()
+{
+	// Overwritten cells are not tracked, so the reference counts can only err on the high
+	// side. Once the table grows large they are recounted from the lines that hold clusters.
+
+	LTIMING("VTPage::SweepClusters");
+
+	for(int& n : clusterrefs)
+		n = 0;
+
+	auto Count = [&](const VTLine& line) {
+		if(!line.HasClusters())
+			return;
+		bool collapsed = line.IsCollapsed();
+		line.Expand();
+		bool found = false;
+		for(int i = 0; i < line.GetCount(); i++)
+			if(line[i].IsCluster()) {
+				RetainCluster(line[i].chr);
+				found = true;
+			}
+		line.Clustered(found);
+		if(collapsed)
+			line.Collapse();
+	};
+
+	for(const VTLine& line : stale)
+		Count(line);
+	for(const VTLine& line : saved)
+		Count(line);
+	for(const VTLine& line : lines)
+		Count(line);
+
+	int live = 0;
+	for(int i = 0; i < clusters.GetCount(); i++)
+		if(clusters.IsUnlinked(i))
+			continue;
+		else
+		if(clusterrefs[i] == 0)
+			clusters.Unlink(i);
+		else
+			live++;
+
+	clustersweep = max(1024, 2 * live);
+	LLOG("SweepClusters() -> live: " << live << ", table size: " << clusters.GetCount());
+}
+
+void VTPage::ClearClusters()
+{
+	clusters.Clear();
+	clusterrefs.Clear();
+	clustersweep = 1024;
+	joining = false;
+}
+
 VTPage& VTPage::RewrapCursor(int n)
 {
 	LLOG("RewrapCursor(" << n << ")");
@@ -712,6 +1694,7 @@ int VTPage::LineInsert(int pos, int n, const VTCell& attrs)
 			{
 				VTLine& line = lines.Insert(pos - 1);
 				line.Adjust(size.cx, attrs);
+				ReleaseClusters(lines[margins.bottom]);
 				lines.Remove(margins.bottom);
 				scrolled++;
 			}
@@ -754,6 +1737,7 @@ int VTPage::LineRemove(int pos, int n, const VTCell& attrs)
 				{
 					SaveToHistory(pos);
 				}
+				ReleaseClusters(lines[pos - 1]);
 				lines.Remove(pos - 1);
 				scrolled++;
 			}
@@ -1127,11 +2111,17 @@ const VTLine& VTPage::FetchLine(int i) const
 	
 	if(0 <= i && i < count)
 	{
-		int slen = saved.GetCount();
+		int slen = GetHistoryCount();
 		int llen = lines.GetCount();
 	
-		if(slen && i < slen)
-			return saved[i];
+		if(slen && i < slen) {
+			const VTLine& line = GetHistoryLine(i);
+			if(line.IsCollapsed()) {
+				line.Expand();
+				expanded++;
+			}
+			return line;
+		}
 		else
 		if(llen && i >= slen)
 			return lines[i - slen];
@@ -1140,7 +2130,22 @@ const VTLine& VTPage::FetchLine(int i) const
 	return VTLine::Void();
 }
 
-bool VTPage::FetchRange(const Rect& r, Gate<const VTLine&, VTLine::ConstRange&> consumer, bool rect) const
+Vector<VTLine> VTPage::GetLines(int i, int count) const
+{
+	LTIMING("VTPage::GetLines");
+
+	int slen = GetHistoryCount();
+	int b = clamp(i, 0, GetLineCount());
+	int e = clamp(i + count, b, GetLineCount());
+
+	Vector<VTLine> v;
+	v.Reserve(e - b);
+	for(int j = b; j < e; j++)
+		v.Add(j < slen ? GetHistoryLine(j) : lines[j - slen]);
+	return v;
+}
+
+bool VTPage::FetchRange(const Rect& r, Gate<const VTLine&, VTLine::ConstRange&, int> consumer, bool rect) const
 {
 	Rect rr = Rect(0, 0, size.cx, GetLineCount());
 	if(IsNull(r) || !rr.Contains(r) || !consumer)
@@ -1149,7 +2154,11 @@ bool VTPage::FetchRange(const Rect& r, Gate<const VTLine&, VTLine::ConstRange&>
 	for(int i = r.top; i <= r.bottom; i++) {
 		const VTLine& line = FetchLine(i);
 		if(!line.IsVoid()) {
-			int length = line.GetCount();
+			// The trailing blanks of the history lines are not stored, but they are selected
+			// as if they were: The consumer gets the stored part of the range, and the number
+			// of blanks that follow it.
+			int count  = line.GetCount();
+			int length = max(count, size.cx);
 			int b = 0, e = length;
 			if(r.top == r.bottom || rect) {
 				b = r.left;
@@ -1165,8 +2174,11 @@ bool VTPage::FetchRange(const Rect& r, Gate<const VTLine&, VTLine::ConstRange&>
 				b = 0;
 				e = min(length, r.right);
 			}
-			auto range  = SubRange(line, b, e);
-			if(consumer(line, range))
+			b = min(b, length); // History lines can be wider than the page.
+			e = clamp(e, 0, length - b);
+			int n = clamp(count - b, 0, e);
+			auto range  = SubRange(line, min(b, count), n);
+			if(consumer(line, range, e - n))
 				return false;
 		}
 	}
@@ -1188,26 +2200,29 @@ void VTPage::RectCopy(const Point &p, const Rect& r, const Rect& rr, dword flags
 	Rect dest(p, src.GetSize());
 	dest.Set(Bind(rr, dest.TopLeft()), Bind(rr, dest.BottomRight()));
 
-	Buffer<VTCell> temp((src.Height() + 1) * (src.Width() + 1));
+	// The source rows are copied to a buffer first, as the rectangles can overlap.
+	int cx = src.Width() + 1;
+	Buffer<VTCell> temp((src.Height() + 1) * cx);
+	bool clustered = false;
 
-	for(int pass = 0; pass < 2; pass++)
-	{
-		const Rect& rx = pass == 0 ? src : dest;
-		for(int i = rx.top, pos = 0; i <= rx.bottom; i++)
-		{
-			VTLine& line = lines[i - 1];
-			for(int j = rx.left; j <= rx.right; j++, pos++)
-			{
-				VTCell& a = line[j - 1];
-				VTCell& b = *(temp + pos);
-				if(pass == 0)
-					b.Fill(a, flags);
-				else
-					a.Fill(b, flags);
-			}
-			if(pass == 1)
-				line.Invalidate();
-		}
+	for(int i = src.top, pos = 0; i <= src.bottom; i++, pos += cx) {
+		const VTLine& line = lines[i - 1];
+		VTCell::Copy(temp + pos, line.begin() + src.left - 1, cx, flags);
+		clustered |= line.HasClusters();
+	}
+
+	int dx = dest.Width() + 1;
+	for(int i = dest.top, pos = 0; i <= dest.bottom; i++, pos += cx) {
+		VTLine& line = lines[i - 1];
+		VTCell *a = line.begin() + dest.left - 1;
+		VTCell::Copy(a, temp + pos, dx, flags);
+		if(clustered)
+			for(int j = 0; j < dx; j++)
+				if(a[j].IsCluster() && a[j].chr == temp[pos + j].chr) {
+					RetainCluster(a[j].chr);
+					line.Clustered();
+				}
+		line.Invalidate();
 	}
 }
 
@@ -1367,6 +2382,177 @@ void VTPage::Xmlize(XmlIO& xio)
 	XmlizeByJsonize(xio, *this);
 }
 
+void VTPage::SaveState(Stream& s, bool withhistory) const
+{
+	LTIMING("VTPage::SaveState");
+
+	ASSERT(s.IsStoring());
+	const_cast<VTPage*>(this)->SerializeState(s, withhistory); // Storing doesn't modify the page.
+}
+
+bool VTPage::LoadState(Stream& s, bool withhistory)
+{
+	LTIMING("VTPage::LoadState");
+
+	ASSERT(s.IsLoading());
+	SerializeState(s, withhistory);
+	return !s.IsError();
+}
+
+void VTPage::SerializeState(Stream& s, bool withhistory)
+{
+	// The counts are checked before anything is allocated: Every stored element takes at
+	// least a byte, so a count can't exceed the rest of the stream.
+	auto Count = [&s](int& n) {
+		s / n;
+		if(s.IsLoading() && (n < 0 || n > 16 * 1024 * 1024 || n > s.GetLeft())) {
+			s.LoadError();
+			n = 0;
+		}
+	};
+
+	int version = 1;
+	s / version;
+	if(version < 1 || version > 1) {
+		LLOG("Unsupported page state version: " << version);
+		s.LoadError();
+		return;
+	}
+
+	s % tabsize;
+	s % historysize;
+	s % history;
+	s % autowrap;
+	s % reversewrap;
+	s % reflow;
+	s % packhistory;
+	s % indexhistory;
+	s % size;
+	if(s.IsLoading() && (int64) max(size.cx, 2) * max(size.cy, 2) > 16 * 1024 * 1024)
+		s.LoadError(); // The page is allocated from the size.
+	s % margins;
+	s % tabs;
+	s % tabsync;
+	s % clustersweep;
+	s % joining;
+	s % dropped;
+	for(Cursor *c : { &cursor, &backup })
+		s % c->x % c->y % c->eol % c->displaced;
+	cellattrs.Serialize(s);
+
+	if(s.IsLoading()) {
+		stale.Clear();
+		saved.Clear();
+	}
+
+	int n = clusters.GetCount();
+	Count(n);
+	if(s.IsLoading()) {
+		clusters.Clear();
+		for(int i = 0; i < n && !s.IsError(); i++) {
+			bool unlinked = false;
+			WString w;
+			s % unlinked % w;
+			clusters.Add(w);
+			if(unlinked)
+				clusters.Unlink(i);
+		}
+	}
+	else
+		for(int i = 0; i < n; i++) {
+			bool unlinked = clusters.IsUnlinked(i);
+			WString w = unlinked ? WString() : clusters[i];
+			s % unlinked % w;
+		}
+	s % clusterrefs;
+
+	int cy = lines.GetCount();
+	Count(cy);
+	if(s.IsLoading())
+		lines.SetCount(cy);
+	for(VTLine& line : lines) {
+		line.Serialize(s);
+		if(s.IsLoading())
+			line.Unpack();
+	}
+
+	if(withhistory) {
+		int m = stale.GetCount();
+		n = GetHistoryCount();
+		Count(m);
+		Count(n);
+		if(s.IsLoading()) {
+			Vector<VTLine> v;
+			v.SetCount(n);
+			for(VTLine& line : v)
+				if(!s.IsError())
+					line.Load(s);
+			SetHistory(pick(v), m);
+		}
+		else
+			for(int i = 0; i < n; i++)
+				GetHistoryLine(i).Save(s);
+	}
+
+	if(s.IsLoading()) {
+		if(s.IsError()) {
+			Reset();
+			return;
+		}
+		historysize = max(1, historysize);
+		clusterrefs.SetCount(clusters.GetCount(), 0);
+		expanded = 0;
+		historygen++;
+		if(!withhistory) {
+			searchindex.Clear();
+			indexstale = false;
+		}
+		size.cx = max(2, size.cx);
+		size.cy = max(2, size.cy);
+		lines.SetCount(size.cy);
+		for(VTLine& line : lines) {
+			if(line.GetCount() < size.cx)
+				line.Adjust(size.cx, cellattrs);
+			line.Invalidate();
+		}
+		if(IsNull(margins) || !GetView().Contains(margins))
+			ResetMargins();
+		for(Cursor *c : { &cursor, &backup }) {
+			c->x = clamp(c->x, 1, size.cx);
+			c->y = clamp(c->y, 1, size.cy);
+		}
+		WhenUpdate();
+	}
+}
+
+void VTPage::SetHistory(Vector<VTLine>&& v, int stalecount)
+{
+	LTIMING("VTPage::SetHistory");
+
+	// The cluster references of the lines must already be accounted for (see LoadState()).
+
+	historygen++;
+	stale.Clear();
+	saved.Clear();
+	stalecount = clamp(stalecount, 0, v.GetCount());
+	for(int i = 0; i < v.GetCount(); i++) {
+		VTLine& line = (i < stalecount ? stale : saved).AddTail(pick(v[i]));
+		if(!packhistory)
+			line.Unpack();
+	}
+	expanded = 0;
+	searchindex.Clear();
+	indexstale = indexhistory && GetHistoryCount() > 0;
+	AdjustHistorySize();
+	WhenUpdate();
+}
+
+void VTPage::UpdateIndex()
+{
+	if(indexstale)
+		ReindexHistory();
+}
+
 String VTPage::Cursor::ToString() const
 {
 	return Format(
@@ -1379,9 +2565,10 @@ WString AsWString(const VTPage& page, const Rect& r, bool rectsel, bool tspaces)
 	Vector<WString> v;
 	bool wrapped = false;
 
-	auto RangeToWString = [&](const VTLine& line, VTLine::ConstRange& range) -> bool
+	auto RangeToWString = [&](const VTLine& line, VTLine::ConstRange& range, int blanks) -> bool
 	{
-		WString s = AsWString(range, tspaces);
+		// The trailing blanks are not converted anyway.
+		WString s = AsWString(range, tspaces, &page);
 		if(!rectsel && (v.GetCount() && wrapped))
 			v.Top() << s;
 		else
@@ -3,12 +3,49 @@
 
 #include <Core/Core.h>
 #include "Cell.h"
+#include "Search.h"
 
 namespace Upp {
 
-class VTLine : public Moveable<VTLine, Vector<VTCell>> {
+class VTPage;
+
+class VTLine : public Moveable<VTLine> {
 public:
+    struct Run : Moveable<Run> {
+        int         begin;                                  // 0-based column.
+        VTCell      attrs;                                  // chr is not used.
+    };
+
     VTLine();
+    VTLine(const VTLine& src);
+    VTLine(VTLine&& src);
+    ~VTLine();
+
+    VTLine&         operator=(const VTLine& src);
+    VTLine&         operator=(VTLine&& src);
+
+    // The cells are stored in a reference counted block that is shared by the copies of
+    // the line (e.g. page snapshots). Any modification detaches the line first.
+    int             GetCount() const                        { return data ? data->cells.GetCount() : 0; }
+    int             GetLength() const                       { return IsCollapsed() ? data->text.GetCount() : GetCount(); }
+    bool            IsEmpty() const                         { return GetCount() == 0; }
+    bool            IsShared() const                        { return data && data->refs > 1; }
+
+    const VTCell&   operator[](int i) const                 { return data->cells[i]; }
+    VTCell&         operator[](int i)                       { return Cells()[i]; }
+    const VTCell&   Get(int i, const VTCell& def) const     { return i >= 0 && i < GetCount() ? data->cells[i] : def; }
+    VTCell&         At(int i)                               { return Cells().At(i); }
+
+    void            SetCount(int n, const VTCell& filler)   { Cells().SetCount(n, filler); }
+    void            Insert(int i, const VTCell& filler, int n) { Cells().Insert(i, filler, n); }
+    void            Remove(int i, int n = 1)                { Cells().Remove(i, n); }
+    void            Clear();
+
+    const VTCell*   begin() const                           { return data ? data->cells.begin() : nullptr; }
+    const VTCell*   end() const                             { return data ? data->cells.end() : nullptr; }
+    VTCell*         begin()                                 { return Cells().begin(); }
+    VTCell*         end()                                   { return Cells().end(); }
+
     void            Adjust(int cx, const VTCell& filler);
     void            ShiftLeft(int begin, int end, int n, const VTCell& filler);
     void            ShiftRight(int begin, int end, int n, const VTCell& filler);
@@ -25,9 +62,41 @@ public:
     void            Unwrap() const                          { wrapped = false; }
     bool            IsWrapped() const                       { return wrapped;  }
 
+    void            Clustered(bool b = true) const          { clustered = b;   }
+    bool            HasClusters() const                     { return clustered; }
+
+    // A packed line holds only its code points and a sorted vector of attribute runs.
+    // Its cells are materialized on demand by Expand() and can be dropped again by
+    // Collapse(). Editing a packed line converts it back to the per-cell form.
+    void            TrimBlanks();
+    void            Pack();
+    void            Unpack();
+    void            Expand() const;
+    void            Collapse() const;
+    bool            IsPacked() const                        { return data && data->packed; }
+    bool            IsCollapsed() const                     { return IsPacked() && data->cells.GetCount() < data->text.GetCount(); }
+    const Vector<Run>* GetRuns() const                      { return IsPacked() ? &data->runs : nullptr; }
+
+    // Calls fn(const VTCell&) for each of the GetLength() cells. Unlike Expand(), this leaves
+    // the line as is, so it can be used by worker threads on the snapshots of shared lines.
+    template <class F>
+    void            Visit(F fn) const;
+
     static const VTLine& Void();
     bool IsVoid() const                                     { return this == &Void(); }
 
+    // Lines are stored in the packed form, and loaded as collapsed, packed lines.
+    void            Save(Stream& s) const;
+    bool            Load(Stream& s);
+    void            Serialize(Stream& s)                    { if(s.IsLoading()) Load(s); else Save(s); }
+
+    // Returns the approximate heap usage of the line. A block that is shared by several
+    // copies of the line is divided among them.
+    int64           GetMemoryUsage() const;
+
+    // Adds the ids of the inline images and the hyperlinks that the line refers to.
+    void            GetResources(Index<dword>& images, Index<dword>& links) const;
+
     String          ToString() const;
     WString         ToWString() const;
 
@@ -35,11 +104,46 @@ public:
     using ConstRange = const SubRangeOf<const Vector<VTCell>>;
 
 private:
+    struct Data {
+        Atomic          refs;
+        Vector<VTCell>  cells;
+        Vector<dword>   text;                               // Packed form.
+        Vector<Run>     runs;
+        bool            packed;
+        Data() : refs(1), packed(false) {}
+    };
+
+    Vector<VTCell>& Cells();
+    void            Detach() const;
+    static void     Release(Data *d);
+
+    mutable Data *data;                                     // Expand() can detach.
     mutable bool invalid:1;
     mutable bool wrapped:1;
+    mutable bool clustered:1;
 };
 
-WString AsWString(VTLine::ConstRange& cellrange, bool tspaces = true);
+template <class F>
+void VTLine::Visit(F fn) const
+{
+    if(!IsCollapsed()) {
+        for(const VTCell& cell : *this)
+            fn(cell);
+        return;
+    }
+    const Data& d = *data;
+    int n = d.text.GetCount();
+    for(int i = 0; i < d.runs.GetCount(); i++) {
+        VTCell cell = d.runs[i].attrs;
+        int e = i + 1 < d.runs.GetCount() ? d.runs[i + 1].begin : n;
+        for(int j = d.runs[i].begin; j < e; j++) {
+            cell.chr = d.text[j];
+            fn(cell);
+        }
+    }
+}
+
+WString AsWString(VTLine::ConstRange& cellrange, bool tspaces = true, const VTPage *page = nullptr);
 
 class VTPage : Moveable<VTPage> {
     struct Cursor
@@ -90,11 +194,23 @@ public:
 
     VTPage&         History(bool b = true);
     bool            HasHistory() const                      { return history; }
-    const Saved&    GetHistory() const                      { return saved;   }
+    const Saved&    GetHistory() const                      { return saved;   } // Lines can be packed.
+    const Saved&    GetStaleHistory() const                 { return stale;   } // Precedes GetHistory().
+    int             GetHistoryCount() const                 { return stale.GetCount() + saved.GetCount(); }
+    VTPage&         PackHistory(bool b = true)              { packhistory = b; return *this; }
+    bool            IsPackingHistory() const                { return packhistory; }
     void            EraseHistory();
     void            SetHistorySize(int sz);
     int             GetHistorySize() const                  { return historysize; };
 
+    // When reflowing, the logical lines (i.e. the lines joined by their wrapped flag) are
+    // rewrapped to the new page width. The history lines that predate the change are
+    // considered stale, and are rewrapped on demand by RewrapHistory().
+    VTPage&         Reflow(bool b = true)                   { reflow = b; return *this; }
+    bool            IsReflowing() const                     { return reflow; }
+    bool            HasStaleHistory() const                 { return !stale.IsEmpty(); }
+    bool            RewrapHistory(int n);
+
     VTPage&         Attributes(const VTCell& attrs)         { cellattrs = attrs; return *this; }
     const VTCell&   GetAttributes() const                   { return cellattrs; }
 
@@ -131,6 +247,7 @@ public:
     const VTCell&   GetCell(Point pt) const                 { return GetCell(pt.x, pt.y);   }
     const VTCell&   GetCell() const                         { return GetCell(cursor);       }
     int             AddCell(const VTCell& cell)             { return CellAdd(cell, cell.GetWidth()); }
+    VTPage&         AddCells(const dword *cps, int n, const VTCell& attrs);
     VTPage&         InsertCell(const VTCell& cell);
     VTPage&         RepeatCell(int n);
 
@@ -201,7 +318,7 @@ public:
     VTPage&         ClearTabs()                              { tabs.Clear(); tabsync = false; return *this; }
 
     void            SetEol(bool b = true)                    { cursor.eol = b;     }
-    void            ClearEol()                               { cursor.eol = false; }
+    void            ClearEol()                               { cursor.eol = joining = false; } // Also ends a ZWJ sequence.
     bool            IsEol() const                            { return cursor.eol;  }
 
     void            Invalidate()                             { for(auto& line : lines) line.Invalidate(); }
@@ -210,14 +327,37 @@ public:
     // Index: 0-based.
     const VTLine&   FetchLine(int i) const;
     const VTLine&   operator[](int i) const                  { return FetchLine(i); }
-    int             GetLineCount() const                     { return lines.GetCount() + saved.GetCount(); }
+    int             GetLineCount() const                     { return lines.GetCount() + GetHistoryCount(); }
+
+    // The serial of a line doesn't change as the line scrolls into the history, or as older
+    // lines are dropped from it. (Resizing the page can renumber the lines.)
+    int64           GetLineSerial(int i) const               { return dropped + i; }
+    int             GetLineIndex(int64 serial) const         { return (int) clamp<int64>(serial - dropped, -1, GetLineCount()); }
+
+    // Text search over the history and the page. The history lines are indexed as they
+    // enter the history, so only the parts of the history that can match are scanned.
+    VTPage&         IndexHistory(bool b = true);
+    bool            IsIndexingHistory() const                { return indexhistory; }
+    Vector<VTMatch> Find(const WString& s, bool ignorecase = true) const;
+
+    // Returns copies of the given lines that share their cells with the page. The copies are
+    // snapshots: They are not affected by the later changes to the page and, as they are never
+    // modified in place, they can be handed over to other threads. (Clusters are not included.)
+    Vector<VTLine>  GetLines(int i, int count) const;
 
     // Point: 0-based.
     const VTCell&   FetchCell(const Point& pt) const;
     const VTCell&   operator()(const Point& pt) const        { return FetchCell(pt);  }
 
-    // Rect: 0-based.
-    bool            FetchRange(const Rect& r, Gate<const VTLine&, VTLine::ConstRange&> consumer, bool rect = false) const;
+    // Rect: 0-based. The range handed to the consumer holds the stored cells only, and is
+    // followed by the given number of blanks (see VTCell::Void()).
+    bool            FetchRange(const Rect& r, Gate<const VTLine&, VTLine::ConstRange&, int> consumer, bool rect = false) const;
+
+    // Grapheme clusters: Cells that hold more than one code point refer to an interned,
+    // reference counted entry of the page's cluster table.
+    dword           AddCluster(const WString& s, bool wide = false);
+    const WString&  GetCluster(dword chr) const;
+    Vector<WString> GetClusters() const;
 
     const VTLine*    begin() const                           { return lines.begin(); }
     VTLine*          begin()                                 { return lines.begin(); }
@@ -228,6 +368,36 @@ public:
     virtual void    Jsonize(JsonIO& jio);
     virtual void    Xmlize(XmlIO& xio);
 
+    // Snapshots: Unlike Serialize(), which only stores the settings, these store the complete
+    // state of the page (lines, cursor, margins, tabs, clusters...). The history can be left
+    // out, to be stored separately by the serials of its lines and restored by SetHistory().
+    // The history generation changes whenever the lines that are already in the history are
+    // modified or renumbered (e.g. by reflowing).
+    void            SaveState(Stream& s, bool withhistory = true) const;
+    bool            LoadState(Stream& s, bool withhistory = true);
+    void            SetHistory(Vector<VTLine>&& lines, int stalecount = 0);
+    int             GetStaleHistoryCount() const            { return stale.GetCount(); }
+    dword           GetHistoryGeneration() const            { return historygen; }
+
+    // A restored history is indexed on demand.
+    void            UpdateIndex();
+
+    // Memory accounting. The usage of the history includes its search index. Both walk the
+    // lines, so they are meant to be called occasionally (e.g. by a memory budget manager).
+    int64           GetPageMemoryUsage() const;
+    int64           GetHistoryMemoryUsage() const;
+    void            GetResources(Index<dword>& images, Index<dword>& links, bool withhistory = true) const;
+
+    // Replaces the cells of the given inline images with blanks, history included.
+    void            EraseImages(const Index<dword>& ids);
+
+    // Packs the history lines and drops their materialized cells. Returns the freed bytes.
+    int64           CompressHistory();
+
+    // Drops the oldest history lines until at least 'bytes' are freed, keeping the newest
+    // 'keep' lines. Returns the freed bytes.
+    int64           TrimHistory(int64 bytes, int keep = 0);
+
 private:
     bool            HorzMarginsExist() const                                        { return margins.Width()  < size.cx - 1; }
     bool            VertMarginsExist() const                                        { return margins.Height() < size.cy - 1; }
@@ -249,17 +419,38 @@ private:
     int             SetTabStop(int col, bool b);
     bool            IsTabStop(int col) const                                        { return tabs[col]; }
     void            AdjustHistorySize();
+    void            DropHistory(int n);
     bool            SaveToHistory(int pos);
     void            UnwindHistory(const Size& prevsize);
     void            RewindHistory(const Size& prevsize);
+    const VTLine&   GetHistoryLine(int i) const                                     { int n = stale.GetCount(); return i < n ? stale[i] : saved[i - n]; }
+    const VTLine&   LineAt(int i) const                                             { int n = GetHistoryCount(); return i < n ? GetHistoryLine(i) : lines[i - n]; }
+    void            ArchiveTail();
+    dword           GetSearchChar(const VTCell& cell) const;
+    void            IndexLine(int pos, const VTLine& line, const VTLine *prev);
+    void            ReindexHistory();
+    void            ReflowPage(const Size& prevsize);
+    void            PullStaleLine(Vector<VTLine>& src);
+    void            RewrapLine(const VTLine *src, int n, Vector<VTLine>& out, int pos = -1, Point *pt = nullptr) const;
     Rect            AdjustRect(const Rect& r, bool displaced = true);
     void            RectFill(const Rect& r, const VTCell& filler, dword flags = 0);
     void            RectCopy(const Point& p, const Rect& r, const Rect& rr, dword flags = 0);
     void            LineFill(int pos, int begin, int end, const VTCell& filler, dword flags = 0);
+    bool            IsJoining(const VTCell& cell, int width) const                  { return width <= 0 || joining || cell.chr - 0x1F1E6 < 26; }
+    bool            CellJoin(const VTCell& cell, int width);
+    void            RetainCluster(dword chr, int n = 1);
+    void            ReleaseCluster(dword chr);
+    void            ReleaseClusters(const VTLine& line);
+    void            SweepClusters();
+    void            ClearClusters();
+    void            CollapseHistory();
+    void            ArchiveLine(VTLine& line, int pos, const VTLine *prev);
+    void            SerializeState(Stream& s, bool withhistory);
 
 private:
     Lines           lines;
     Saved           saved;
+    Saved           stale;
     Cursor          cursor;
     Cursor          backup;
     Size            size;
@@ -270,8 +461,21 @@ private:
     bool            history;
     bool            autowrap;
     bool            reversewrap;
+    bool            reflow;
     bool            tabsync;
     VTCell          cellattrs;
+    Index<WString>  clusters;
+    Vector<int>     clusterrefs;
+    int             clustersweep;
+    bool            joining;
+    bool            packhistory;
+    mutable int     expanded;
+    VTSearchIndex   searchindex;
+    Vector<dword>   indextext;
+    bool            indexhistory;
+    bool            indexstale;
+    int64           dropped;
+    dword           historygen;
 };
 
 WString AsWString(const VTPage& page, const Rect& r, bool rectsel = false, bool tspaces = true);
@@ -563,12 +563,24 @@ void VTInStream::CollectChr(int c)
 {
 	LTIMING("VtInStream::CollectChr()");
 
-	int p = -1;
+	dword run[256];
+	bool bulk = (bool) WhenChrs;
+	int  n = 0, p = -1;
 	while(sCheckRange(c, 0x20, 0x7E) || c > 0x9F) {
-		WhenChr(c);
+		if(!bulk)
+			WhenChr(c);
+		else {
+			run[n++] = c;
+			if(n == __countof(run)) {
+				WhenChrs(run, n);
+				n = 0;
+			}
+		}
 		p = GetPos();
 		c = GetChr();
 	}
+	if(n)
+		WhenChrs(run, n);
 	if(c != -1)
 		Seek(p);
 	waschr = true;
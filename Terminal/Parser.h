@@ -91,6 +91,7 @@ public:
     bool    WasChr() const                                  { return waschr; }
     
     Event<int>  WhenChr;
+    Event<const dword*, int> WhenChrs; // If set, printable characters are passed on in runs.
     Event<byte> WhenCtl;
     Event<const VTInStream::Sequence&>  WhenEsc;
     Event<const VTInStream::Sequence&>  WhenCsi;
@@ -0,0 +1,462 @@
+#include "Terminal.h"
+
+#define LLOG(x)		// RLOG("VTRecorder: " << x)
+#define LTIMING(x)	// RTIMING(x)
+
+namespace Upp {
+
+// Returns the length of the incomplete UTF-8 sequence at the end of the string, if any.
+// asciicast stores the data as JSON strings, so a multibyte character that is split
+// between two writes has to be carried over to the next record.
+
+static int sUtf8Tail(const String& s)
+{
+	int n = s.GetLength();
+	for(int i = 1; i <= min(4, n); i++) {
+		byte c = s[n - i];
+		if((c & 0xC0) == 0x80)
+			continue;
+		int len = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+		return len > i ? i : 0;
+	}
+	return 0;
+}
+
+VTRecorder::VTRecorder()
+: pendingsize(0)
+, start(0)
+, epoch(0)
+, granularity(5000)
+, flushinterval(250)
+, format(VTREC_ASCIICAST)
+, quit(false)
+, error(false)
+{
+}
+
+VTRecorder::~VTRecorder()
+{
+	Close();
+}
+
+bool VTRecorder::Open(const char *path, Size pagesize)
+{
+	Close();
+
+	if(!out.Open(path)) {
+		LLOG("Couldn't open " << path);
+		error = true;
+		return false;
+	}
+
+	error = false;
+	quit  = false;
+	start = usecs();
+	epoch = GetUtcTime() - Time(1970, 1, 1);
+
+	if(format == VTREC_ASCIICAST) {
+		Json header;
+		header("version", 2)("width", pagesize.cx)("height", pagesize.cy)("timestamp", epoch);
+		if(!IsNull(title))
+			header("title", title);
+		out << header.ToString() << "\n";
+	}
+
+	writer.Run([=, this] { Work(); });
+	return true;
+}
+
+void VTRecorder::Close()
+{
+	if(writer.IsOpen()) {
+		{
+			Mutex::Lock __(lock);
+			quit = true;
+			cv.Signal();
+		}
+		writer.Wait();
+	}
+	if(out.IsOpen())
+		out.Close();
+	pending.Clear();
+	pendingsize = 0;
+	otail.Clear();
+	itail.Clear();
+}
+
+void VTRecorder::Output(const void *data, int size)
+{
+	Put('o', data, size);
+}
+
+void VTRecorder::Input(const String& s)
+{
+	Put('i', ~s, s.GetLength());
+}
+
+void VTRecorder::Resize(Size sz)
+{
+	String s;
+	s << sz.cx << "x" << sz.cy;
+	Put('r', ~s, s.GetLength());
+}
+
+void VTRecorder::Put(char type, const void *data, int size)
+{
+	// This is called from the GUI thread, so it only timestamps the data and queues it.
+	// Consecutive chunks of the same type that arrive within the granularity interval
+	// are merged into a single record. Encoding and file I/O are left to the writer.
+
+	if(!writer.IsOpen() || size <= 0 || (format == VTREC_TTYREC && type != 'o'))
+		return;
+
+	int64 t = usecs() - start;
+
+	Mutex::Lock __(lock);
+	if(pending.GetCount()) {
+		Record& r = pending.Top();
+		if(r.type == type && t - r.time <= granularity) {
+			r.data.Cat((const char *) data, size);
+			pendingsize += size;
+			return;
+		}
+	}
+	Record& r = pending.Add();
+	r.time = t;
+	r.type = type;
+	r.data = String((const char *) data, size);
+	if((pendingsize += size) >= 65536)
+		cv.Signal();
+}
+
+void VTRecorder::Work()
+{
+	String buffer;
+	for(;;) {
+		Vector<Record> records;
+		bool done;
+		{
+			Mutex::Lock __(lock);
+			if(!quit && pendingsize < 65536)
+				cv.Wait(lock, flushinterval);
+			records = pick(pending);
+			pending.Clear();
+			pendingsize = 0;
+			done = quit;
+		}
+		if(records.GetCount()) {
+			buffer.Clear();
+			Encode(records, buffer);
+			out.Put(buffer);
+			out.Flush();
+			if(out.IsError()) {
+				LLOG("Write error.");
+				error = true;
+			}
+		}
+		if(done)
+			break;
+	}
+}
+
+void VTRecorder::Encode(const Vector<Record>& records, String& buffer)
+{
+	LTIMING("VTRecorder::Encode");
+
+	for(const Record& r : records) {
+		if(format == VTREC_TTYREC) {
+			int64 t = epoch * 1000000 + r.time;
+			char h[12];
+			Poke32le(h,     (int)(t / 1000000));
+			Poke32le(h + 4, (int)(t % 1000000));
+			Poke32le(h + 8, r.data.GetLength());
+			buffer.Cat(h, 12);
+			buffer.Cat(r.data);
+			continue;
+		}
+		String s;
+		if(r.type == 'r') // Resize records do not take part in the streams.
+			s = r.data;
+		else {
+			// An incomplete UTF-8 sequence at the end is held back until the next record.
+			String& tail = r.type == 'i' ? itail : otail;
+			s = tail + r.data;
+			int n = sUtf8Tail(s);
+			tail = s.Right(n);
+			s.Trim(s.GetLength() - n);
+			if(s.IsEmpty())
+				continue;
+		}
+		buffer << "[" << FormatF(r.time / 1000000.0, 6) << ", \"" << r.type << "\", " << AsJSON(s) << "]\n";
+	}
+}
+
+VTPlayer::VTPlayer()
+: keyinterval(30000000)
+, keylimit(64 * 1024 * 1024)
+, keybytes(0)
+, term(nullptr)
+, pagesize(Null)
+, cursor(0)
+, position(0)
+, basetime(0)
+, speed(1.0)
+, playing(false)
+{
+}
+
+VTPlayer::~VTPlayer()
+{
+	timer.Kill();
+}
+
+VTPlayer& VTPlayer::Speed(double x)
+{
+	position = GetPosition();
+	basetime = usecs();
+	speed = x;
+	return *this;
+}
+
+bool VTPlayer::Load(const char *path)
+{
+	FileIn in(path);
+	return in && Load(in);
+}
+
+bool VTPlayer::Load(Stream& in)
+{
+	Clear();
+	bool ok = in.Peek() == '{' ? LoadAsciicast(in) : LoadTtyrec(in);
+	if(!ok)
+		Clear();
+	LLOG("Loaded " << frames.GetCount() << " frames, duration: " << GetDuration() << " usecs");
+	return ok;
+}
+
+bool VTPlayer::LoadAsciicast(Stream& in)
+{
+	Value header = ParseJSON(in.GetLine());
+	if(IsError(header) || (int) header["version"] != 2) {
+		LLOG("Unsupported asciicast header.");
+		return false;
+	}
+	pagesize = Size((int) header["width"], (int) header["height"]);
+	while(!in.IsEof()) {
+		String line = in.GetLine();
+		if(IsNull(line))
+			continue;
+		Value v = ParseJSON(line);
+		if(IsError(v) || v.GetCount() != 3) {
+			LLOG("Invalid asciicast record: " << line);
+			return false;
+		}
+		Frame& f = frames.Add();
+		f.time = (int64)((double) v[0] * 1000000);
+		f.type = ((String) v[1])[0];
+		f.data = v[2];
+	}
+	return true;
+}
+
+bool VTPlayer::LoadTtyrec(Stream& in)
+{
+	int64 t0 = Null;
+	while(!in.IsEof()) {
+		int64 sec  = (dword) in.Get32le();
+		int64 usec = (dword) in.Get32le();
+		int   len  = in.Get32le();
+		if(in.IsError() || len < 0) {
+			LLOG("Invalid ttyrec header.");
+			return false;
+		}
+		Frame& f = frames.Add();
+		f.data = in.Get(len);
+		if(f.data.GetLength() != len) {
+			LLOG("Truncated ttyrec frame.");
+			return false;
+		}
+		int64 t = sec * 1000000 + usec;
+		if(IsNull(t0))
+			t0 = t;
+		f.time = t - t0;
+		f.type = 'o';
+	}
+	return true;
+}
+
+void VTPlayer::Clear()
+{
+	Stop();
+	frames.Clear();
+	ClearKeyframes();
+	pagesize = Null;
+}
+
+void VTPlayer::Play(TerminalCtrl& t)
+{
+	if(term != &t) {
+		term = &t;
+		cursor = 0;
+		position = 0;
+		ClearKeyframes();
+	}
+	if(cursor >= frames.GetCount())
+		Stop();
+	playing  = true;
+	basetime = usecs();
+	Tick();
+}
+
+void VTPlayer::Pause()
+{
+	position = GetPosition();
+	playing  = false;
+	timer.Kill();
+}
+
+void VTPlayer::Stop()
+{
+	Pause();
+	cursor   = 0;
+	position = 0;
+}
+
+int64 VTPlayer::GetPosition() const
+{
+	if(!playing || speed <= 0.0)
+		return position;
+	return min(position + (int64)((usecs() - basetime) * speed), GetDuration());
+}
+
+void VTPlayer::Seek(int64 usec)
+{
+	if(!term)
+		return;
+
+	bool resume = playing;
+	Pause();
+
+	usec = clamp(usec, (int64) 0, GetDuration());
+	if(cursor > 0 && frames[cursor - 1].time > usec && !RestoreKeyframe(usec)) {
+		// Rewinding: the page is rebuilt from the start of the recording.
+		term->HardReset();
+		cursor = 0;
+	}
+	FastForward(usec);
+	position = usec;
+
+	if(resume) {
+		playing  = true;
+		basetime = usecs();
+		Tick();
+	}
+}
+
+void VTPlayer::FastForward(int64 usec)
+{
+	while(cursor < frames.GetCount() && frames[cursor].time <= usec) {
+		Feed(frames[cursor++]);
+		AddKeyframe();
+	}
+}
+
+void VTPlayer::AddKeyframe()
+{
+	if(keyinterval <= 0 || cursor >= frames.GetCount())
+		return;
+
+	int64 last = keyframes.IsEmpty() ? 0 : frames[keyframes.Top().cursor - 1].time;
+	if(frames[cursor - 1].time - last < keyinterval || (keyframes.GetCount() && keyframes.Top().cursor >= cursor))
+		return;
+
+	LTIMING("VTPlayer::AddKeyframe");
+
+	StringStream ss;
+	term->SaveSnapshot(ss);
+	Keyframe& k = keyframes.Add();
+	k.cursor   = cursor;
+	k.snapshot = ss.GetResult();
+	keybytes  += k.snapshot.GetLength();
+
+	// Snapshots include the history and the images, so the keyframes are bounded by their
+	// total size. Thinning them out keeps the rest spread over the recording.
+	while(keybytes > keylimit && keyframes.GetCount()) {
+		int n = keyframes.GetCount();
+		if(n <= 2) {
+			keybytes -= keyframes[0].snapshot.GetLength();
+			keyframes.Remove(0);
+			continue;
+		}
+		for(int i = n - 2; i > 0; i -= 2) {
+			keybytes -= keyframes[i].snapshot.GetLength();
+			keyframes.Remove(i);
+		}
+	}
+}
+
+bool VTPlayer::RestoreKeyframe(int64 usec)
+{
+	for(int i = keyframes.GetCount() - 1; i >= 0; i--) {
+		const Keyframe& k = keyframes[i];
+		if(frames[k.cursor - 1].time <= usec) {
+			StringStream ss(k.snapshot);
+			if(!term->LoadSnapshot(ss))
+				break;
+			cursor = k.cursor;
+			return true;
+		}
+	}
+	return false;
+}
+
+void VTPlayer::Feed(const Frame& f)
+{
+	switch(f.type) {
+	case 'o':
+		term->WriteUtf8(f.data);
+		break;
+	case 'r': {
+		int x = f.data.Find('x');
+		if(x > 0) {
+			Size sz(Nvl(ScanInt(f.data.Left(x)), 0), Nvl(ScanInt(f.data.Mid(x + 1)), 0));
+			if(sz.cx > 0 && sz.cy > 0)
+				term->WhenSetSize(term->PageSizeToClient(sz));
+		}
+		break;
+	}
+	default: // Keyboard input ('i') and markers ('m') are not fed back.
+		break;
+	}
+}
+
+void VTPlayer::Tick()
+{
+	if(!playing || !term)
+		return;
+
+	if(speed <= 0.0) {
+		// At maximum speed we still yield to the GUI every 20 ms or so.
+		int64 t0 = usecs();
+		while(cursor < frames.GetCount() && usecs() - t0 < 20000) {
+			Feed(frames[cursor++]);
+			AddKeyframe();
+		}
+		position = cursor ? frames[cursor - 1].time : 0;
+	}
+	else
+		FastForward(GetPosition());
+
+	if(cursor >= frames.GetCount()) {
+		playing  = false;
+		position = GetDuration();
+		WhenFinish();
+		return;
+	}
+
+	int delay = 0;
+	if(speed > 0.0)
+		delay = (int) clamp<int64>((int64)((frames[cursor].time - GetPosition()) / speed / 1000), 0, 1000);
+	timer.KillSet(delay, [=, this] { Tick(); });
+}
+}
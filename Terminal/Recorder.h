@@ -0,0 +1,134 @@
+#ifndef _VTRecorder_h_
+#define _VTRecorder_h_
+
+#include <Core/Core.h>
+#include <CtrlCore/CtrlCore.h>
+
+namespace Upp {
+
+class TerminalCtrl;
+
+// Session recording formats.
+
+enum VTRecordFormats {
+    VTREC_ASCIICAST = 0,  // asciicast v2 (https://docs.asciinema.org/manual/asciicast/v2/)
+    VTREC_TTYREC          // ttyrec (output only)
+};
+
+class VTRecorder : NoCopy {
+public:
+    VTRecorder();
+    virtual ~VTRecorder();
+
+    VTRecorder&     SetFormat(int fmt)              { format = fmt; return *this; }
+    int             GetFormat() const               { return format; }
+    VTRecorder&     Title(const String& s)          { title = s; return *this; }
+    VTRecorder&     Granularity(int ms)             { granularity = max(0, ms) * 1000; return *this; }
+    VTRecorder&     FlushInterval(int ms)           { flushinterval = max(10, ms); return *this; }
+
+    bool            Open(const char *path, Size pagesize);
+    void            Close();
+    bool            IsOpen() const                  { return out.IsOpen(); }
+    bool            IsError() const                 { return error != 0; }
+
+    void            Output(const void *data, int size);
+    void            Input(const String& s);
+    void            Resize(Size sz);
+
+private:
+    struct Record : Moveable<Record> {
+        int64       time;
+        char        type;
+        String      data;
+    };
+
+    void            Put(char type, const void *data, int size);
+    void            Work();
+    void            Encode(const Vector<Record>& records, String& buffer);
+
+    FileOut         out;
+    Thread          writer;
+    Mutex           lock;
+    ConditionVariable cv;
+    Vector<Record>  pending;
+    int             pendingsize;
+    String          otail, itail;
+    String          title;
+    int64           start;
+    int64           epoch;
+    int64           granularity;
+    int             flushinterval;
+    int             format;
+    bool            quit;
+    Atomic          error;          // Also set by the writer thread.
+};
+
+class VTPlayer : NoCopy {
+public:
+    VTPlayer();
+    virtual ~VTPlayer();
+
+    Event<>         WhenFinish;
+
+    VTPlayer&       Speed(double x);
+    VTPlayer&       RealTime()                      { return Speed(1.0); }
+    VTPlayer&       MaxSpeed()                      { return Speed(0.0); }
+    double          GetSpeed() const                { return speed; }
+
+    bool            Load(const char *path);
+    bool            Load(Stream& in);
+    void            Clear();
+
+    void            Play(TerminalCtrl& t);
+    void            Pause();
+    void            Stop();
+    bool            IsPlaying() const               { return playing; }
+
+    // Keyframes are snapshots of the terminal, taken while playing. Seeking backwards then
+    // restores the nearest keyframe instead of replaying the recording from the start.
+    VTPlayer&       KeyframeInterval(int64 usec)    { keyinterval = max((int64) 0, usec); return *this; }
+    VTPlayer&       KeyframeMemory(int64 bytes)     { keylimit = max((int64) 0, bytes); return *this; }
+    VTPlayer&       NoKeyframes()                   { ClearKeyframes(); return KeyframeInterval(0); }
+
+    void            Seek(int64 usec);
+    int64           GetPosition() const;
+    int64           GetDuration() const             { return frames.GetCount() ? frames.Top().time : 0; }
+    Size            GetPageSize() const             { return pagesize; }
+
+private:
+    struct Frame : Moveable<Frame> {
+        int64       time;
+        char        type;
+        String      data;
+    };
+
+    struct Keyframe : Moveable<Keyframe> {
+        int         cursor;                         // The first frame that is not applied.
+        String      snapshot;
+    };
+
+    bool            LoadAsciicast(Stream& in);
+    bool            LoadTtyrec(Stream& in);
+    void            Tick();
+    void            Feed(const Frame& f);
+    void            FastForward(int64 usec);
+    void            AddKeyframe();
+    void            ClearKeyframes()                { keyframes.Clear(); keybytes = 0; }
+    bool            RestoreKeyframe(int64 usec);
+
+    Vector<Frame>   frames;
+    Vector<Keyframe> keyframes;
+    int64           keyinterval;
+    int64           keylimit;                       // The memory budget of the keyframes, in bytes.
+    int64           keybytes;
+    TimeCallback    timer;
+    TerminalCtrl   *term;
+    Size            pagesize;
+    int             cursor;
+    int64           position;
+    int64           basetime;
+    double          speed;
+    bool            playing;
+};
+}
+#endif
@@ -19,6 +19,7 @@ public:
 	
 private:
 	Draw&		w;
+	const VTPage& page;
 	Rect		rect;
 	WString		text;
 	Point		textpos;
@@ -40,8 +41,9 @@ private:
 	ImageParts&	imageparts;
 	
 public:
-	Renderer(Draw& w, ImageParts& im, Font f, Size sz, Color bkg, bool bt, bool tr)
+	Renderer(Draw& w, const VTPage& pg, ImageParts& im, Font f, Size sz, Color bkg, bool bt, bool tr)
 		: w(w)
+		, page(pg)
 		, imageparts(im)
 		, font(f)
 		, fsz(sz)
@@ -112,6 +114,15 @@ public:
 			if(dxcount)
 				dx.Top() += csz.cx;
 		}
+		else
+		if(cell.chr & VTCell::CLUSTER) {
+			// The marks and joined code points don't advance the pen.
+			const WString& s = page.GetCluster(cell.chr);
+			for(int i = 0; i < s.GetCount(); i++) {
+				text.Cat(s[i]);
+				dx.Add(i ? 0 : csz.cx);
+			}
+		}
 		else {
 			text.Cat((int) cell.chr);
 			dx.Add(csz.cx);
@@ -166,6 +177,9 @@ void TerminalCtrl::Paint0(Draw& w, bool print)
 {
 	GuiLock __;
 
+	if(!print)
+		lastviewed = usecs(); // See EnforceMemoryBudget().
+
 	int  pos = GetSbPos();
 	Size wsz = GetSize();
 	Size psz = GetPageSize();
@@ -176,6 +190,7 @@ void TerminalCtrl::Paint0(Draw& w, bool print)
 
 	Renderer rr(
 		w,
+		*page,
 		imageparts,
 		font,
 		GetFontSize(),
@@ -192,18 +207,45 @@ void TerminalCtrl::Paint0(Draw& w, bool print)
 		w.DrawRect(wsz, colortable[COLOR_PAPER]);
 	for(int i = pos; i < min(pos + psz.cy, page->GetLineCount()); ++i) {
 		int y = i * csz.cy - (csz.cy * pos);
+		int64 serial = page->GetLineSerial(i);
 		const VTLine& line = page->FetchLine(i);
 		if(!line.IsVoid() && w.IsPainting(0, y, wsz.cx, csz.cy)) {
+			// Packed (history) lines carry their attribute runs, so the colors are
+			// resolved once per run instead of once per cell.
+			const Vector<VTLine::Run> *runs = line.GetRuns();
+			int  run = 0, runend = -1;
+			Color runink, runpaper;
 			Renderer::Attrs *la = lineattrs;
 			for(int j = 0; j < psz.cx; ++j, ++la) {
-				la->cell = &line.Get(j, GetAttrs());
+				la->cell = &line.Get(j, VTCell::Void());
 				la->x = j * csz.cx;
 				la->y = y;
 				la->is_link = hyperlinks && la->cell->IsHyperlink();
+				int match = -1;
 				if((la->highlighted = IsSelected(Point(j, i)))) {
 					la->ink   = colortable[COLOR_INK_SELECTED];
 					la->paper = colortable[COLOR_PAPER_SELECTED];
 				}
+				else
+				if(!matches.IsEmpty() && (match = GetMatchAt(serial, j)) >= 0) {
+					// The current match is painted as a selection, the others are dimmed.
+					la->highlighted = true;
+					la->ink   = colortable[COLOR_INK_SELECTED];
+					la->paper = match == matchindex
+					          ? colortable[COLOR_PAPER_SELECTED]
+					          : Blend(colortable[COLOR_PAPER_SELECTED], colortable[COLOR_PAPER]);
+				}
+				else
+				if(runs && j < line.GetCount()) {
+					if(j >= runend) {
+						while(run + 1 < runs->GetCount() && (*runs)[run + 1].begin <= j)
+							run++;
+						runend = run + 1 < runs->GetCount() ? (*runs)[run + 1].begin : line.GetCount();
+						SetInkAndPaperColor(*la->cell, runink, runpaper);
+					}
+					la->ink   = runink;
+					la->paper = runpaper;
+				}
 				else {
 					SetInkAndPaperColor(*la->cell, la->ink, la->paper);
 				}
@@ -268,10 +310,13 @@ void TerminalCtrl::PaintImages(Draw& w, ImageParts& parts, const Size& csz)
 		const Rect&  rr = part.c;
 		Rect r(pt, rr.GetSize());
 		if(w.IsPainting(r)) {
-			InlineImage im = GetCachedImageData(id, Null, csz);
-			if(!IsNull(im.image)) {
-				im.paintrect = rr;	// Keep it updated.
-				im.fontsize  = csz;	// Keep it updated.
+			const VTImageStore::Entry *e = GetImageEntry(id);
+			if(e && !IsNull(e->image)) {
+				InlineImage im;
+				im.image     = e->image;
+				im.cellsize  = e->cellsize;
+				im.paintrect = rr;
+				im.fontsize  = csz;
 				imgdisplay->Paint(w, r, im, colortable[COLOR_INK], colortable[COLOR_PAPER], 0);
 			}
 		}
@@ -286,111 +331,309 @@ void TerminalCtrl::RenderImage(const ImageString& imgs, bool scroll)
 	bool encoded = imgs.encoded; // Sixel images are not base64 encoded.
 
 	if(WhenImage) {
-		WhenImage(encoded ? Base64Decode(imgs.data) : imgs.data);
+		WhenImage(encoded ? VTBase64Decoder::Decode(imgs.data) : imgs.data);
 		return;
 	}
 
 	LTIMING("TerminalCtrl::RenderImage");
 
 	Size fsz = GetCellSize();
-	dword id = FoldHash(CombineHash(imgs, fsz));
-	const InlineImage& imd = GetCachedImageData(id, imgs, fsz);
-	if(!IsNull(imd.image)) {
-		page->AddImage(imd.cellsize, id, scroll, encoded);
+	uint64 key = GetImageKey(imgs, fsz);
+
+	// The image is already decoded, or being decoded.
+	bool found = false;
+	dword id = GetImageId(key, found);
+	if(found) {
+		int i = pendingimages.Find(id);
+		page->AddImage(i >= 0 ? pendingimages[i].cellsize : inlineimages.Get(id)->cellsize, id, scroll, encoded);
 		RefreshDisplay();
+		return;
 	}
-}
 
-// Shared image data cache support.
+	if(VTImageStore::Entry *e = VTImageStore::Acquire(key)) {
+		inlineimages.Add(id, e);
+		page->AddImage(e->cellsize, id, scroll, encoded);
+		RefreshDisplay();
+		return;
+	}
 
-static StaticMutex sImageCacheLock;
-static LRUCache<TerminalCtrl::InlineImage> sInlineImagesCache;
-static int sCachedImageMaxSize =  1024 * 1024 * 4 * 128;
-static int sCachedImageMaxCount =  256000;
+	// If the size of the image can be determined without decoding it, the cells are reserved
+	// right away, and the image is decoded by a worker. Otherwise, or if there are too many
+	// images in the queue, it is decoded synchronously, which also throttles the input.
+	Size isz = maximagejobs > 0 && imagejobs < maximagejobs ? ProbeImageSize(imgs) : Null;
+	if(IsNull(isz)) {
+		Image img = DecodeImage(imgs);
+		if(IsNull(img))
+			return;
+		VTImageStore::Entry *e = VTImageStore::Add(key, img, GetImageCellSize(img.GetSize(), fsz));
+		inlineimages.Add(id, e);
+		page->AddImage(e->cellsize, id, scroll, encoded);
+		PruneImages();
+		RefreshDisplay();
+		return;
+	}
+
+	PendingImage& p = pendingimages.Add(id);
+	p.key      = key;
+	p.cellsize = GetImageCellSize(isz, fsz);
+	page->AddImage(p.cellsize, id, scroll, encoded);
+	PruneImages();
+	RefreshDisplay();
+
+	imagejobs++;
+	imagework & [=, this] {
+		Image img = DecodeImage(imgs);
+		PostImage(id, key, pick(img));
+		imagejobs--;
+	};
+}
 
-String TerminalCtrl::InlineImageMaker::Key() const
+void TerminalCtrl::PostImage(dword id, uint64 key, Image&& img)
 {
-	StringBuffer h;
-	RawCat(h, id);
-	return String(h); // Make MSVC happy...
+	// Called by the workers.
+	{
+		Mutex::Lock __(imagelock);
+		DecodedImage& m = decodedimages.Add();
+		m.id    = id;
+		m.key   = key;
+		m.image = pick(img);
+	}
+	KillSetTimeCallback(0, [=, this] { FlushImages(); }, TIMEID_IMAGES);
 }
 
-int TerminalCtrl::InlineImageMaker::Make(InlineImage& imagedata) const
+void TerminalCtrl::FlushImages()
 {
-	LTIMING("TerminalCtrl::ImageDataMaker::Make");
+	LTIMING("TerminalCtrl::FlushImages");
 
-	auto ToCellSize = [=, this](Sizef sz) -> Size
+	Vector<DecodedImage> v;
 	{
-		sz = sz / Sizef(fontsize);
-		return Size(fround(sz.cx), fround(sz.cy));
-	};
+		Mutex::Lock __(imagelock);
+		v = pick(decodedimages);
+		decodedimages.Clear();
+	}
 
-	auto AdjustSize = [=, this](Size sr, Size sz) -> Size
-	{
-		if(imgs.keepratio) {
-			if(sr.cx == 0 && sr.cy > 0)
-				sr.cx = sr.cy * sz.cx / sz.cy;
-			else
-			if(sr.cy == 0 && sr.cx > 0)
-				sr.cy = sr.cx * sz.cy / sz.cx;
+	for(DecodedImage& m : v) {
+		int i = pendingimages.Find(m.id);
+		if(i < 0 || pendingimages[i].key != m.key) // Dropped meanwhile.
+			continue;
+		Size csz = pendingimages[i].cellsize;
+		pendingimages.Remove(i);
+		if(IsNull(m.image)) {
+			LLOG("Unable to decode image. Image id: " << m.id);
+			continue;
 		}
-		else {
-			if(sr.cx <= 0)
-				sr.cx = sz.cx;
-			if(sr.cy <= 0)
-				sr.cy = sz.cy;
+		// The image keeps the cell size that was reserved for it.
+		inlineimages.Add(m.id, VTImageStore::Add(m.key, m.image, csz));
+		RefreshImage(m.id);
+	}
+	PruneImages();
+}
+
+void TerminalCtrl::RefreshImage(dword id)
+{
+	// Only the cells of the image are refreshed.
+
+	Size psz = GetPageSize();
+	Size csz = GetCellSize();
+	int  pos = GetSbPos();
+	int  cnt = min(pos + psz.cy, page->GetLineCount());
+
+	Rect r = Null;
+	for(int i = pos; i < cnt; i++) {
+		const VTLine& line = page->FetchLine(i);
+		int y = (i - pos) * csz.cy;
+		for(int j = 0; j < line.GetCount(); j++) {
+			const VTCell& cell = line[j];
+			if(cell.IsImage() && cell.chr == id) {
+				Rect rr = RectC(j * csz.cx, y, csz.cx, csz.cy);
+				r = IsNull(r) ? rr : r | rr;
+			}
 		}
-		return sr != sz ? sr : Null;
+	}
+	if(!IsNull(r))
+		Refresh(r.Inflated(4));
+}
+
+void TerminalCtrl::CancelImages()
+{
+	imagework.Cancel(); // Waits for the running jobs.
+	imagejobs = 0;
+	KillTimeCallback(TIMEID_IMAGES);
+	pendingimages.Clear();
+	Mutex::Lock __(imagelock);
+	decodedimages.Clear();
+}
+
+// Shared image store support.
+
+uint64 TerminalCtrl::GetImageKey(const ImageString& imgs, const Size& fsz)
+{
+	uint64 h = VTImageStore::Hash(imgs.data);
+	dword params[] = {
+		(dword) fsz.cx,
+		(dword) fsz.cy,
+		IsNull(imgs.size) ? 0xFFFFFFFF : (dword) imgs.size.cx,
+		IsNull(imgs.size) ? 0xFFFFFFFF : (dword) imgs.size.cy,
+		(dword) imgs.encoded | ((dword) imgs.keepratio << 1) | ((dword) imgs.transparent << 2)
 	};
+	return VTImageStore::Hash(params, sizeof(params), h);
+}
+
+Size TerminalCtrl::GetImageCellSize(Size isz, const Size& fsz)
+{
+	Sizef sz = Sizef(isz) / Sizef(fsz);
+	return Size(fround(sz.cx), fround(sz.cy));
+}
+
+Size TerminalCtrl::GetImageTargetSize(const ImageString& imgs, Size sz)
+{
+	// Returns the size the image is rescaled to, or Null.
+
+	if(IsNull(imgs.size))
+		return Null;
+
+	Size sr = imgs.size;
+	if(imgs.keepratio) {
+		if(sr.cx == 0 && sr.cy > 0)
+			sr.cx = sr.cy * sz.cx / max(sz.cy, 1);
+		else
+		if(sr.cy == 0 && sr.cx > 0)
+			sr.cy = sr.cx * sz.cy / max(sz.cx, 1);
+	}
+	else {
+		if(sr.cx <= 0)
+			sr.cx = sz.cx;
+		if(sr.cy <= 0)
+			sr.cy = sz.cy;
+	}
+	return sr != sz ? sr : Null;
+}
+
+Size TerminalCtrl::ProbeImageSize(const ImageString& imgs)
+{
+	// Reads the size from the image header, or from the raster attributes of sixel images.
+	// Only the head of an encoded image is decoded here.
+
+	LTIMING("TerminalCtrl::ProbeImageSize");
+
+	Size sz = Null;
+	if(!imgs.encoded)
+		sz = SixelStream::GetRasterSize(imgs.data);
+	else {
+		StringStream ss(VTBase64Decoder::Decode(~imgs.data, min(imgs.data.GetLength(), 64 * 1024)));
+		One<StreamRaster> r = StreamRaster::OpenAny(ss);
+		if(r)
+			sz = r->GetSize();
+	}
+	if(IsNull(sz) || sz.cx <= 0 || sz.cy <= 0)
+		return Null;
+	Size tsz = GetImageTargetSize(imgs, sz);
+	return IsNull(tsz) ? sz : tsz;
+}
+
+Image TerminalCtrl::DecodeImage(const ImageString& imgs)
+{
+	LTIMING("TerminalCtrl::DecodeImage");
 
 	Image img;
 	if(!imgs.encoded) {
 		img = (Image) SixelStream(imgs.data).Background(!imgs.transparent);
 	}
 	else {
-		img = StreamRaster::LoadStringAny(Base64Decode(imgs.data));
+		img = StreamRaster::LoadStringAny(VTBase64Decoder::Decode(imgs.data));
 	}
 
 	if(IsNull(img))
-		return 0;
-	if(IsNull(imgs.size))
-		imagedata.image = img;
-	else {
-		Size sz = AdjustSize(imgs.size, img.GetSize());
-		imagedata.image = IsNull(sz) ? img : Rescale(img, sz);
+		return img;
+	Size sz = GetImageTargetSize(imgs, img.GetSize());
+	return IsNull(sz) ? img : Rescale(img, sz);
+}
+
+dword TerminalCtrl::GetImageId(uint64 key, bool& found)
+{
+	// The cells refer to the images by 32-bit ids that are unique within the terminal. The
+	// terminal holds a single reference to each image.
+
+	dword id = (dword)(key ^ (key >> 32));
+	for(;; id++) {
+		int i = inlineimages.Find(id);
+		if(i >= 0) {
+			if(inlineimages[i]->key == key)
+				break;
+			continue;
+		}
+		i = pendingimages.Find(id);
+		if(i >= 0) {
+			if(pendingimages[i].key == key)
+				break;
+			continue;
+		}
+		if(restoredimages.Find(id) < 0) {
+			found = false;
+			return id;
+		}
 	}
-	imagedata.fontsize = fontsize;
-	imagedata.cellsize = ToCellSize(imagedata.image.GetSize());
-	return imagedata.image.GetLength() * 4;
+	found = true;
+	return id;
 }
 
-const TerminalCtrl::InlineImage& TerminalCtrl::GetCachedImageData(dword id, const ImageString& imgs, const Size& csz)
+void TerminalCtrl::PruneImages()
 {
-	Mutex::Lock __(sImageCacheLock);
+	// The images that are no longer displayed are released in batches.
+	if(inlineimages.GetCount() + pendingimages.GetCount() > 2 * max(64, imagecount))
+		PruneResources();
+}
+
+const VTImageStore::Entry* TerminalCtrl::GetImageEntry(dword id)
+{
+	int i = inlineimages.Find(id);
+	if(i >= 0)
+		return inlineimages[i];
+
+	// The images of a restored snapshot are decoded when they are first displayed.
+	i = restoredimages.Find(id);
+	if(i < 0)
+		return nullptr;
 
-	LTIMING("TerminalCtrl::GetCachedImageData");
+	LTIMING("TerminalCtrl::GetImageEntry (restored)");
 
-	InlineImageMaker im(id, imgs, csz);
-	sInlineImagesCache.Shrink(sCachedImageMaxSize, sCachedImageMaxCount);
-	return sInlineImagesCache.Get(im);
+	Size fsz = GetCellSize();
+	uint64 key = VTImageStore::Hash(restoredimages[i]);
+	VTImageStore::Entry *e = VTImageStore::Acquire(key);
+	if(!e) {
+		Image img = StreamRaster::LoadStringAny(restoredimages[i]);
+		if(IsNull(img))
+			return nullptr;
+		e = VTImageStore::Add(key, img, GetImageCellSize(img.GetSize(), fsz));
+	}
+	restoredimages.Remove(i);
+	inlineimages.Add(id, e);
+	return e;
+}
+
+void TerminalCtrl::ReleaseImages()
+{
+	CancelImages();
+	for(VTImageStore::Entry *e : inlineimages)
+		VTImageStore::Release(e);
+	inlineimages.Clear();
 }
 
 void TerminalCtrl::ClearImageCache()
 {
-	Mutex::Lock __(sImageCacheLock);
-	sInlineImagesCache.Clear();
+	VTImageStore::Purge();
 }
 
 void TerminalCtrl::SetImageCacheMaxSize(int maxsize, int maxcount)
 {
-	Mutex::Lock __(sImageCacheLock);
-	sCachedImageMaxSize  = max(1, maxsize);
-	sCachedImageMaxCount = max(1, maxcount);
+	VTImageStore::SetMaxSize(max(1, maxsize), max(1, maxcount));
 }
 
 void TerminalCtrl::RenderHyperlink(const String& uri)
 {
-	GetCachedHyperlink(FoldHash(GetHashValue(uri)), uri);
+	dword id = FoldHash(GetHashValue(uri));
+	linksizes.GetAdd(id) = uri.GetLength();
+	GetCachedHyperlink(id, uri);
 }
 
 // Shared hyperlink cache support.
@@ -0,0 +1,311 @@
+#include "Page.h"
+
+#define LLOG(x)		// RLOG("VTSearch: " << x)
+#define LTIMING(x)	// RTIMING(x)
+
+namespace Upp {
+
+bool VTMatch::Contains(int64 serial, int x) const
+{
+	return (serial > line || (serial == line && x >= col))
+		&& (serial < endline || (serial == endline && x < endcol));
+}
+
+String VTMatch::ToString() const
+{
+	return Format("[%d:%d - %d:%d]", line, col, endline, endcol);
+}
+
+dword VTSearchIndex::Hash(dword a, dword b, dword c)
+{
+	dword h = a * 0x9E3779B1;
+	h = (h ^ (h >> 15) ^ b) * 0x85EBCA77;
+	h = (h ^ (h >> 13) ^ c) * 0xC2B2AE3D;
+	return h ^ (h >> 16);
+}
+
+void VTSearchIndex::Clear()
+{
+	blocks.Clear();
+	count = 0;
+}
+
+void VTSearchIndex::Insert(int pos, const dword *text, int len, bool continued)
+{
+	LTIMING("VTSearchIndex::Insert");
+
+	pos = clamp(pos, 0, count);
+
+	Block *b = nullptr;
+	bool head = false;
+	if(pos == count) {
+		if(blocks.IsEmpty() || blocks.Tail().count >= BLOCKLINES)
+			blocks.AddTail();
+		b = &blocks.Tail();
+		head = b->count == 0;
+	}
+	else {
+		// Lines inserted in the middle (i.e. rewrapped history lines) can grow a block beyond
+		// BLOCKLINES. This only makes its filter less selective.
+		int i = 0, start = 0;
+		while(start + blocks[i].count <= pos)
+			start += blocks[i++].count;
+		b = &blocks[i];
+		head = start == pos;
+	}
+
+	if(head && continued)
+		b->continued = true;
+
+	for(int i = 0; i + 2 < len; i++)
+		Set(*b, Hash(Fold(text[i]), Fold(text[i + 1]), Fold(text[i + 2])));
+
+	b->count++;
+	count++;
+}
+
+void VTSearchIndex::Remove(int pos, int n)
+{
+	LTIMING("VTSearchIndex::Remove");
+
+	pos = clamp(pos, 0, count);
+	n = clamp(n, 0, count - pos);
+	if(n == 0)
+		return;
+
+	count -= n;
+
+	int i = 0, start = 0;
+	while(start + blocks[i].count <= pos)
+		start += blocks[i++].count;
+
+	int first = i;
+	for(int offset = pos - start; n > 0; i++, offset = 0) {
+		Block& b = blocks[i];
+		int k = min(n, b.count - offset);
+		b.count -= k;
+		n -= k;
+		if(offset == 0 && b.count > 0) // The new first line can be a continuation.
+			b.continued = true;
+	}
+
+	// Only the blocks in [first, i) can be empty now. Those at either end are simply dropped.
+	int dropped = 0;
+	while(!blocks.IsEmpty() && blocks.Head().count == 0) {
+		blocks.DropHead();
+		dropped++;
+	}
+	while(!blocks.IsEmpty() && blocks.Tail().count == 0)
+		blocks.DropTail();
+
+	// The others (e.g. when reflowing removes lines from the middle) are compacted away.
+	first = max(first - dropped, 0);
+	i = min(i - dropped, blocks.GetCount());
+	while(first < i && blocks[first].count > 0)
+		first++;
+	if(first == i)
+		return;
+	int j = first;
+	bool gap = false;
+	for(int k = first; k < blocks.GetCount(); k++) {
+		if(blocks[k].count == 0) {
+			gap = true;
+			continue;
+		}
+		if(j != k)
+			blocks[j] = blocks[k];
+		if(gap) // The block follows different lines now.
+			blocks[j].continued = true;
+		gap = false;
+		j++;
+	}
+	blocks.DropTail(blocks.GetCount() - j);
+}
+
+Vector<Tuple<int, int>> VTSearchIndex::Query(const dword *text, int len) const
+{
+	LTIMING("VTSearchIndex::Query");
+
+	Vector<dword> hashes;
+	for(int i = 0; i + 2 < len; i++)
+		hashes.Add(Hash(text[i], text[i + 1], text[i + 2]));
+
+	// A match that crosses a wrapped line can have its trigrams split between two blocks.
+	Vector<Tuple<int, int>> ranges;
+	const Block *prev = nullptr;
+	for(int i = 0, start = 0; i < blocks.GetCount(); i++) {
+		const Block& b = blocks[i];
+		if(b.count == 0)
+			continue;
+		bool found = true;
+		for(int j = 0; found && j < hashes.GetCount(); j++)
+			found = Test(b, hashes[j]) || (b.continued && prev && Test(*prev, hashes[j]));
+		if(found) {
+			if(ranges.GetCount() && ranges.Top().b == start)
+				ranges.Top().b += b.count;
+			else
+				ranges.Add(MakeTuple(start, start + b.count));
+		}
+		start += b.count;
+		prev = &b;
+	}
+	return ranges;
+}
+
+dword VTPage::GetSearchChar(const VTCell& cell) const
+{
+	// Returns 0 for the cells that have no text of their own (the second halves of wide
+	// characters). Clusters are represented by their first code point.
+
+	if(cell.chr == 0 || cell.IsImage())
+		return ' ';
+	if(cell.chr == 1)
+		return 0;
+	if(cell.IsCluster()) {
+		const WString& s = GetCluster(cell.chr);
+		return s.GetCount() ? s[0] : ' ';
+	}
+	return cell.chr;
+}
+
+VTPage& VTPage::IndexHistory(bool b)
+{
+	LLOG("IndexHistory(" << b << ")");
+
+	if(b && !indexhistory) {
+		indexhistory = true;
+		ReindexHistory();
+	}
+	else
+	if(!b) {
+		indexhistory = false;
+		searchindex.Clear();
+	}
+	return *this;
+}
+
+void VTPage::ReindexHistory()
+{
+	LTIMING("VTPage::ReindexHistory");
+
+	searchindex.Clear();
+	indexstale = false;
+	for(int i = 0; i < GetHistoryCount(); i++)
+		IndexLine(i, GetHistoryLine(i), i ? &GetHistoryLine(i - 1) : nullptr);
+}
+
+void VTPage::IndexLine(int pos, const VTLine& line, const VTLine *prev)
+{
+	if(!indexhistory || indexstale)
+		return;
+
+	LTIMING("VTPage::IndexLine");
+
+	// The text of a line that continues the previous one starts with the last two characters
+	// of the previous line, so that the trigrams across the wrap are indexed too.
+
+	Vector<dword>& s = indextext;
+	s.Clear();
+
+	auto ForEachCell = [](const VTLine& line, auto fn) {
+		bool collapsed = line.IsCollapsed();
+		line.Expand();
+		fn(line);
+		if(collapsed)
+			line.Collapse();
+	};
+
+	bool continued = prev && prev->IsWrapped();
+	if(continued)
+		ForEachCell(*prev, [&](const VTLine& l) {
+			for(int i = l.GetCount() - 1; i >= 0 && s.GetCount() < 2; i--)
+				if(dword c = GetSearchChar(l[i]))
+					s.Insert(0, c);
+		});
+
+	ForEachCell(line, [&](const VTLine& l) {
+		for(const VTCell& cell : l)
+			if(dword c = GetSearchChar(cell))
+				s.Add(c);
+	});
+
+	searchindex.Insert(pos, s.begin(), s.GetCount(), continued);
+}
+
+Vector<VTMatch> VTPage::Find(const WString& s, bool ignorecase) const
+{
+	LTIMING("VTPage::Find");
+
+	Vector<VTMatch> matches;
+	if(s.IsEmpty())
+		return matches;
+
+	Vector<dword> q, fq;
+	for(int c : s) {
+		q.Add(ignorecase ? VTSearchIndex::Fold(c) : c);
+		fq.Add(VTSearchIndex::Fold(c));
+	}
+
+	// The candidates are the history blocks that the index yields, plus the page itself.
+	int hcount = GetHistoryCount();
+	int total  = GetLineCount();
+	Vector<Tuple<int, int>> ranges;
+	if(indexhistory && searchindex.GetCount() == hcount)
+		ranges = searchindex.Query(fq.begin(), fq.GetCount());
+	else
+	if(hcount)
+		ranges.Add(MakeTuple(0, hcount));
+	ranges.Add(MakeTuple(hcount, total));
+
+	// The candidate lines are scanned as logical lines, i.e. the wrapped lines are joined.
+	Vector<dword> text;
+	Vector<Point> cells;
+	Vector<int>   ends;
+	int next = 0;
+	for(const Tuple<int, int>& r : ranges) {
+		int i = max(r.a, next);
+		while(i > next && LineAt(i - 1).IsWrapped())
+			i--;
+		while(i < r.b) {
+			text.Clear();
+			cells.Clear();
+			ends.Clear();
+			int j = i;
+			for(;; j++) {
+				const VTLine& line = LineAt(j);
+				bool collapsed = line.IsCollapsed();
+				line.Expand();
+				for(int x = 0; x < line.GetCount(); x++)
+					if(dword c = GetSearchChar(line[x])) {
+						text.Add(ignorecase ? VTSearchIndex::Fold(c) : c);
+						cells.Add(Point(x, j));
+						ends.Add(x + max(1, line[x].GetWidth()));
+					}
+				bool wrapped = line.IsWrapped();
+				if(collapsed)
+					line.Collapse();
+				if(!wrapped || j + 1 >= total)
+					break;
+			}
+			for(int k = 0; k + q.GetCount() <= text.GetCount();) {
+				if(memcmp(&text[k], q.begin(), q.GetCount() * sizeof(dword)) == 0) {
+					int l = k + q.GetCount() - 1;
+					VTMatch& m = matches.Add();
+					m.line    = GetLineSerial(cells[k].y);
+					m.col     = cells[k].x;
+					m.endline = GetLineSerial(cells[l].y);
+					m.endcol  = ends[l];
+					k += q.GetCount();
+				}
+				else
+					k++;
+			}
+			i = j + 1;
+		}
+		next = max(next, i);
+	}
+
+	LLOG("Find(" << s << ") -> " << matches.GetCount() << " matches");
+	return matches;
+}
+}
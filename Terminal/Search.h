@@ -0,0 +1,70 @@
+#ifndef _VTSearch_h_
+#define _VTSearch_h_
+
+#include <Core/Core.h>
+
+namespace Upp {
+
+// A match found by the text search. The lines are identified by their serial numbers (see
+// VTPage::GetLineSerial()), so the matches stay put as the lines scroll into the history.
+
+struct VTMatch : Moveable<VTMatch> {
+    int64           line;                                   // Serial of the first line.
+    int             col;                                    // 0-based column of the first cell.
+    int64           endline;                                // Serial of the last line.
+    int             endcol;                                 // 0-based column after the last cell.
+    bool            Contains(int64 serial, int x) const;
+    String          ToString() const;
+};
+
+// A coarse full-text index over the history lines. The lines are grouped into blocks, and each
+// block keeps a Bloom filter of the (case-folded) trigrams of its lines. A query only yields
+// the blocks that can hold all of its trigrams. The filters have no false negatives, so lines
+// that are removed from a block merely leave stale bits behind until the block is dropped.
+
+class VTSearchIndex {
+public:
+    VTSearchIndex()                                         { Clear(); }
+
+    // Indexes the text of a line at 'pos'. 'continued' means that the line continues
+    // the previous one; its text should then begin with the tail of the previous line.
+    void            Insert(int pos, const dword *text, int len, bool continued);
+    void            Add(const dword *text, int len, bool continued) { Insert(count, text, len, continued); }
+    void            Remove(int pos, int n);
+    void            DropHead(int n)                         { Remove(0, n); }
+    void            DropTail(int n)                         { Remove(count - n, n); }
+    void            Clear();
+
+    int             GetCount() const                        { return count; }
+    bool            IsEmpty() const                         { return count == 0; }
+    int64           GetMemoryUsage() const                  { return (int64) blocks.GetCount() * sizeof(Block); }
+
+    // Returns the [begin, end) ranges of lines that can contain the text. The text must be
+    // case-folded. Texts shorter than a trigram match every line.
+    Vector<Tuple<int, int>> Query(const dword *text, int len) const;
+
+    static dword    Fold(dword c)                           { return ToLower(c); }
+
+private:
+    enum { BLOCKLINES = 128, BLOCKBITS = 8192 };
+
+    struct Block : Moveable<Block> {
+        int         count;
+        bool        continued;                              // The first line can continue the previous block.
+        dword       bits[BLOCKBITS / 32];
+        Block()                                             { count = 0; continued = false; memset(bits, 0, sizeof(bits)); }
+    };
+
+    // Each trigram sets two bits, taken from the low and high halves of its hash.
+    static dword    Hash(dword a, dword b, dword c);
+    static void     Set(Block& b, dword h)                  { SetBit(b, h); SetBit(b, h >> 16); }
+    static bool     Test(const Block& b, dword h)           { return TestBit(b, h) && TestBit(b, h >> 16); }
+    static void     SetBit(Block& b, dword h)               { h &= BLOCKBITS - 1; b.bits[h >> 5] |= 1u << (h & 31); }
+    static bool     TestBit(const Block& b, dword h)        { h &= BLOCKBITS - 1; return b.bits[h >> 5] & (1u << (h & 31)); }
+
+    BiVector<Block> blocks;
+    int             count;
+};
+
+}
+#endif
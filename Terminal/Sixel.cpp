@@ -5,16 +5,28 @@
 
 namespace Upp {
 
+SixelStream::SixelStream()
+: src(nullptr)
+, srclen(0)
+, background(true)
+{
+	Clear();
+}
+
 SixelStream::SixelStream(const void *data, int64 size)
-: MemReadStream(data, size)
+: src(data)
+, srclen(size)
 , background(true)
 {
+	Clear();
 }
 
 SixelStream::SixelStream(const String& data)
-: MemReadStream(~data, data.GetLength())
+: src(~data)
+, srclen(data.GetLength())
 , background(true)
 {
+	Clear();
 }
 
 void SixelStream::Clear()
@@ -38,46 +50,19 @@ void SixelStream::Clear()
 		{ (RGBA) White()    },
 	};
 
+	pixels.Clear();
 	size    = Size(0, 0);
-	cursor  = Point(0, 1);
+	extent  = Size(0, 0);
+	raster  = Size(0, 0);
+	cursor  = Point(0, 0);
 	repeat  = 0;
+	count   = 0;
+	state   = DATA;
 	ink     = palette[0];
 	ink.a   = 0xFF;
 	paper   = ink;
 
 	Zero(params);
-	
-	buffer.Create(1024, 1024);
-	Fill(buffer, buffer.GetSize(), background ? paper : RGBAZero());
-	
-	CalcYOffests();
-}
-
-force_inline
-int SixelStream::ReadParams()
-{
-	LTIMING("SixelStream::ReadParams");
-	
-	Zero(params);
-	int c = 0, n = 0, i = 0;
-	for(;;) {
-		while((c = Peek()) > 0x2F && c < 0x3A)
-			n = n * 10 + (Get() - 0x30);
-		params[i++ & 7] = n;
-		if(c != ';')
-			break;
-		n = 0;
-		Get(); // faster than Stream::Skip(1)
-	}
-	return i;
-}
-
-force_inline
-void SixelStream::CalcYOffests()
-{
-	int w = buffer.GetWidth();
-	for(int i = 0, y = cursor.y * w; i < 6; i++, y += w)
-		coords[i] = y;
 }
 
 force_inline
@@ -89,11 +74,8 @@ void SixelStream::Return()
 force_inline
 void SixelStream::LineFeed()
 {
-	size.cx = max(size.cx, cursor.x);
 	cursor.x =  0;
 	cursor.y += 6;
-	size.cy = max(size.cy, cursor.y);
-	CalcYOffests();
 }
 
 static Color sHSLColor(int h, int s, int l)
@@ -128,19 +110,19 @@ static Color sHSLColor(int h, int s, int l)
 		(int) clamp((b + m) * 100.0 + 0.5, 0.0, 100.0));
 }
 
-force_inline
 void SixelStream::SetPalette()
 {
 	LTIMING("SixelStream::SetPalette");
-	
-	int n = ReadParams();
-	if(n == 5) {
+
+	if(params[0] >= MAX_COLORS)
+		return;
+	if(count == 5) {
 		switch(params[1]) {
 		case 2: { // RGB
 			RGBA& rgba = palette.At(params[0]);
-			rgba.r = (params[2] * 255 + 99) / 100;
-			rgba.g = (params[3] * 255 + 99) / 100;
-			rgba.b = (params[4] * 255 + 99) / 100;
+			rgba.r = (min(params[2], 100) * 255 + 99) / 100;
+			rgba.g = (min(params[3], 100) * 255 + 99) / 100;
+			rgba.b = (min(params[4], 100) * 255 + 99) / 100;
 			break;
 		}
 		case 1: { // HLS
@@ -155,110 +137,243 @@ void SixelStream::SetPalette()
 		}
 	}
 	else
-	if(n == 1) {
+	if(count == 1) {
 		ink = palette.At(params[0]);
 		ink.a = 0xFF;
 	}
 }
 
-force_inline
-void SixelStream::GetRasterInfo()
+void SixelStream::SetRasterInfo()
 {
-	LTIMING("SixelStream::GetRasterInfo");
-	ReadParams(); // We don't use the raster info.
+	LTIMING("SixelStream::SetRasterInfo");
+
+	// "Pan;Pad;Ph;Pv: The aspect ratio is ignored. The image size is the minimum size of the
+	// image. It is not used to allocate the canvas, as it can't be trusted.
+	if(count < 4 || params[2] <= 0 || params[3] <= 0)
+		return;
+	if(params[2] <= MAX_SIZE && params[3] <= MAX_SIZE && (int64) params[2] * params[3] <= MAX_AREA)
+		raster = Size(params[2], params[3]);
 }
 
-force_inline
-void SixelStream::GetRepeatCount()
+bool SixelStream::Reserve(int cx, int cy)
 {
-	LTIMING("SixelStream::GetRepeatCount");
+	if(cx <= size.cx && cy <= size.cy)
+		return true;
+	if(cx > MAX_SIZE || cy > MAX_SIZE)
+		return false;
 
-	ReadParams();
-	repeat += max(1, params[0]); // Repeat compression.
-}
+	LTIMING("SixelStream::Reserve");
 
-void SixelStream::AdjustBufferSize()
-{
-	if((cursor.x + repeat >= 4096) || (cursor.y + 6 >= 4096))
-		throw Exc("Sixel canvas size is too big > (4096 x 4096)");
-	ImageBuffer ibb(buffer.GetSize() += 512);
-	Copy(ibb, Point(0, 0), buffer, buffer.GetSize());
-	buffer = ibb;
-	CalcYOffests();
+	// The canvas grows geometrically, so the copying is amortized linear.
+	Size sz = size;
+	if(cx > sz.cx)
+		sz.cx = min(max(cx, 2 * sz.cx, 256), (int) MAX_SIZE);
+	if(cy > sz.cy)
+		sz.cy = min(max(cy, 2 * sz.cy, 192), (int) MAX_SIZE);
+	if((int64) sz.cx * sz.cy > MAX_AREA) {
+		sz = max(size, Size(cx, cy));
+		if((int64) sz.cx * sz.cy > MAX_AREA)
+			return false;
+	}
+
+	LLOG("Canvas: " << size << " -> " << sz);
+
+	Vector<RGBA> v;
+	v.SetCount(sz.cx * sz.cy);
+	Fill(v.begin(), background ? paper : RGBAZero(), v.GetCount());
+	for(int y = 0; y < size.cy; y++)
+		memcpy(v.begin() + y * sz.cx, pixels.begin() + y * size.cx, size.cx * sizeof(RGBA));
+	pixels = pick(v);
+	size = sz;
+	return true;
 }
 
 force_inline
 void SixelStream::PaintSixel(int c)
 {
-	LTIMING("SixelStream::PaintSixel");
-	
-	Size sz = buffer.GetSize();
-	if((sz.cx < cursor.x + repeat) || (sz.cy < cursor.y))
-		AdjustBufferSize();
-
-	if(!repeat) {
-		for(int n = 0; n < 6; ++n) {
-			*(buffer + ((c >> n) & 1) * (coords[n] + cursor.x)) = ink;
+	int n = max(repeat, 1);
+	repeat = 0;
+
+	int x = cursor.x;
+	cursor.x += n;
+	if(x + n > size.cx || cursor.y + 6 > size.cy)
+		if(!Reserve(x + n, cursor.y + 6)) { // Clipped.
+			n = min(n, size.cx - x);
+			if(n <= 0 || cursor.y + 6 > size.cy)
+				return;
 		}
-		size.cx = max(size.cx, ++cursor.x);
+
+	if(c) {
+		int h = 6;
+		while(!(c & (1 << (h - 1))))
+			h--;
+		extent.cy = max(extent.cy, cursor.y + h);
 	}
-	else {
-		for(int n = 0; n < 6; ++n) {
-			if(c & (1 << n)) {
-				Fill(buffer + coords[n] + cursor.x, ink, repeat); // Takes advantage of CPU-intrinsics.
+	extent.cx = max(extent.cx, x + n);
+
+	int w = size.cx;
+	RGBA *p = pixels.begin() + cursor.y * w + x;
+	if(n == 1) {
+		// A single column is written without branches: Each pixel is either kept or
+		// replaced by the ink, selected by a mask.
+		static_assert(sizeof(RGBA) == sizeof(dword), "RGBA must be 32-bit");
+		dword k;
+		memcpy(&k, &ink, sizeof(dword));
+		dword *q = (dword *) p;
+		auto Put = [&](int i) {
+			dword m = 0 - (dword)((c >> i) & 1);
+			dword& d = q[i * w];
+			d = (d & ~m) | (k & m);
+		};
+		Put(0);
+		Put(1);
+		Put(2);
+		Put(3);
+		Put(4);
+		Put(5);
+	}
+	else
+		for(int i = 0; i < 6; i++)
+			if(c & (1 << i))
+				Fill(p + i * w, ink, n); // Takes advantage of CPU-intrinsics.
+}
+
+void SixelStream::Begin(State s)
+{
+	Zero(params);
+	count = 1;
+	state = s;
+}
+
+void SixelStream::End()
+{
+	switch(state) {
+	case REPEAT:
+		repeat += max(1, params[0]); // Repeat compression.
+		break;
+	case RASTER:
+		SetRasterInfo();
+		break;
+	case COLOR:
+		SetPalette();
+		break;
+	default:
+		break;
+	}
+	state = DATA;
+}
+
+void SixelStream::Put(const void *data, int len)
+{
+	LTIMING("SixelStream::Put");
+
+	const byte *s = (const byte *) data;
+	const byte *e = s + len;
+	while(s < e && state != END) {
+		int c = *s++ & 0x7F;
+		if(state != DATA) {
+			// The parameters can be split between the chunks.
+			if(c >= '0' && c <= '9') {
+				int& p = params[(count - 1) & 7];
+				p = min(p * 10 + (c - '0'), 0xFFFFF);
+				continue;
+			}
+			if(c == ';') {
+				if(count++ < 8)
+					params[count - 1] = 0;
+				continue;
 			}
+			End();
+		}
+		switch(c) {
+		case 0x21:
+			Begin(REPEAT);
+			break;
+		case 0x22:
+			Begin(RASTER);
+			break;
+		case 0x23:
+			Begin(COLOR);
+			break;
+		case 0x24:
+			Return();
+			break;
+		case 0x2D:
+			LineFeed();
+			break;
+		case 0x18:
+		case 0x1A:
+		case 0x1B:
+		case 0x1C:
+			state = END;
+			break;
+		default:
+			if(c > 0x3E && c < 0x7F)
+				PaintSixel(c - 0x3F);
+			break;
 		}
-		size.cx = max(size.cx, cursor.x += repeat);
-		repeat = 0;
 	}
 }
 
-SixelStream::operator Image()
+Image SixelStream::GetResult()
 {
-	Clear();
+	LTIMING("SixelStream::GetResult");
+
+	if(state != DATA && state != END)
+		End();
 
+	Size sz = max(raster, extent);
+	if(sz.cx <= 0 || sz.cy <= 0)
+		return Image();
+
+	// The part of the image outside the canvas is blank.
+	ImageBuffer ib(sz);
+	Size csz = min(sz, size);
+	if(csz != sz)
+		Fill(~ib, background ? paper : RGBAZero(), ib.GetLength());
+	for(int y = 0; y < csz.cy; y++)
+		memcpy(ib[y], pixels.begin() + y * size.cx, csz.cx * sizeof(RGBA));
+	return Image(ib);
+}
+
+SixelStream::operator Image()
+{
 	LTIMING("SixelStream::Get");
-		
-	try {
-		for(;;) {
-			int c = Get() & 0x7F;
-			switch(c) {
-			case 0x21:
-				GetRepeatCount();
-				break;
-			case 0x22:
-				GetRasterInfo();
-				break;
-			case 0x23:
-				SetPalette();
-				break;
-			case 0x24:
-				Return();
-				break;
-			case 0x2D:
-				LineFeed();
-				break;
-			case 0x18:
-			case 0x1A:
-			case 0x1B:
-			case 0x1C:
-				goto Finalize;
-			case 0x7F:
-				if(IsEof())
-					goto Finalize;
-				break;
-			default:
-				if(c > 0x3E)
-					PaintSixel(c - 0x3F);
-				break;
-			}
+
+	if(src && srclen > 0) {
+		const char *s = (const char *) src;
+		for(int64 n = srclen; n > 0; ) {
+			int len = (int) min<int64>(n, INT_MAX);
+			Put(s, len);
+			s += len;
+			n -= len;
 		}
 	}
-	catch(const Exc& e) {
-		LLOG(e);
+	return GetResult();
+}
+
+Size SixelStream::GetRasterSize(const String& data)
+{
+	// The raster attributes ("Pan;Pad;Ph;Pv) must precede the sixel data.
+	const char *s = data.Begin(), *e = data.End();
+	while(s < e && *s != '"') {
+		if(*s == '!' || *s == '#' || (*s >= 0x3F && *s <= 0x7E))
+			return Null;
+		s++;
+	}
+	int p[4] = { 0 };
+	int i = 0;
+	for(s++; s < e && i < 4; s++) {
+		if(*s >= '0' && *s <= '9')
+			p[i] = min(p[i] * 10 + (*s - '0'), 1 << 20);
+		else
+		if(*s == ';')
+			i++;
+		else
+			break;
 	}
-	
-Finalize:
-	return !IsError() ? Crop(buffer, 0, 1, size.cx, size.cy) : Image();
+	if(p[2] <= 0 || p[3] <= 0 || p[2] > MAX_SIZE || p[3] > MAX_SIZE || (int64) p[2] * p[3] > MAX_AREA)
+		return Null;
+	return Size(p[2], p[3]);
+}
 }
-}
\ No newline at end of file
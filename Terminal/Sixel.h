@@ -6,36 +6,56 @@
 
 namespace Upp{
 
-class SixelStream : MemReadStream {
+// The decoder is incremental: The data can be passed to Put() in arbitrarily split chunks, and
+// the image is retrieved by GetResult() at the end. The canvas grows geometrically with the
+// painted area. The raster attributes only set the minimum size of the image.
+
+class SixelStream {
 public:
+    SixelStream();
     SixelStream(const void *data, int64 size);
     SixelStream(const String& data);
     
     SixelStream&    Background(bool b = true)       { background = b; return *this;  }
+
+    void            Put(const void *data, int size);
+    void            Put(const String& s)            { Put(~s, s.GetLength()); }
+    Image           GetResult();
     operator        Image();
-    
+
+    // Returns the image size declared by the raster attributes, or Null. Sizes that exceed the
+    // limits of the decoder are ignored, as they are by the decoder.
+    static Size     GetRasterSize(const String& data);
+
 private:
+    enum { MAX_SIZE = 4096, MAX_AREA = 4096 * 4096, MAX_COLORS = 1024 };
+    enum State : byte { DATA, REPEAT, RASTER, COLOR, END };
+
     void            Clear();
+    void            Begin(State s);
+    void            End();
     inline void     Return();
     inline void     LineFeed();
     void            SetPalette();
-    void            GetRasterInfo();
-    void            GetRepeatCount();
-    int             ReadParams();
-    void            CalcYOffests();
-    void            AdjustBufferSize();
+    void            SetRasterInfo();
+    bool            Reserve(int cx, int cy);
     void            PaintSixel(int c);
 
 private:
-    ImageBuffer     buffer;
+    Vector<RGBA>    pixels;                         // The canvas.
     Vector<RGBA>    palette;
     RGBA            ink;
     RGBA            paper;
     int             repeat;
     int             params[8];
-    int             coords[6];
-    Size            size;
+    int             count;                          // Parameters.
+    Size            size;                           // Of the canvas.
+    Size            extent;                         // The painted area.
+    Size            raster;
     Point           cursor;
+    const void     *src;
+    int64           srclen;
+    State           state;
     bool            background;
 };
 }
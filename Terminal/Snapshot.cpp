@@ -0,0 +1,426 @@
+#include "Terminal.h"
+
+#include <plugin/png/png.h>
+
+#define LLOG(x)		// RLOG("VTSnapshot: " << x)
+#define LTIMING(x)	// RTIMING(x)
+
+namespace Upp {
+
+static const char sMagic[] = "VTSNAP";
+static const int  sVersion = 1;
+static const int  sChunkLines = 1024;
+
+static void sPutHeader(Stream& out)
+{
+	out.Put(sMagic, 6);
+	out.Put32le(sVersion);
+}
+
+static void sPutRecord(Stream& out, int type, const String& payload)
+{
+	out.Put(type);
+	out.Put32le(payload.GetLength());
+	out.Put(payload);
+}
+
+void TerminalCtrl::SerializeSnapshotState(Stream& s, int64& hfirst, int& hcount, int& hstale)
+{
+	int version = 1;
+	s / version;
+	if(version < 1 || version > 1) {
+		LLOG("Unsupported state version: " << version);
+		s.LoadError();
+		return;
+	}
+
+	Serialize(s); // Settings.
+	s % modes;
+	s % gsets;
+	s % gsets_backup;
+	cellattrs.Serialize(s);
+	cellattrs_backup.Serialize(s);
+	s % udk;
+	s % savedcolors;
+
+	bool alternate = IsAlternatePage();
+	s % alternate;
+
+	if(s.IsStoring()) {
+		apage.SaveState(s);
+		dpage.SaveState(s, false);
+		hfirst = dpage.GetLineSerial(0);
+		hcount = dpage.GetHistoryCount();
+		hstale = dpage.GetStaleHistoryCount();
+	}
+	else {
+		apage.LoadState(s);
+		dpage.LoadState(s, false);
+		AlternateScreenBuffer(alternate);
+	}
+	s % hfirst;
+	s / hcount / hstale;
+}
+
+void TerminalCtrl::SaveSnapshotResources(Stream& out, const VTLine& line, Index<dword>& images, Index<dword>& links)
+{
+	// Writes the images and the hyperlinks that the line refers to, unless they are already
+	// written.
+
+	line.Visit([&](const VTCell& cell) {
+		if(cell.IsImage() && images.Find(cell.chr) < 0) {
+			images.Add(cell.chr);
+			int i = restoredimages.Find(cell.chr);
+			String png;
+			if(i >= 0)
+				png = restoredimages[i];
+			else {
+				const VTImageStore::Entry *e = GetImageEntry(cell.chr);
+				if(e && !IsNull(e->image))
+					png = PNGEncoder().SaveString(e->image);
+			}
+			if(png.GetCount()) {
+				StringStream ss;
+				dword id = cell.chr;
+				ss % id % png;
+				sPutRecord(out, 'I', ss.GetResult());
+			}
+		}
+		else
+		if(cell.IsHyperlink() && links.Find(cell.data) < 0) {
+			links.Add(cell.data);
+			String uri = GetCachedHyperlink(cell.data);
+			if(uri.GetCount()) {
+				StringStream ss;
+				dword id = cell.data;
+				ss % id % uri;
+				sPutRecord(out, 'L', ss.GetResult());
+			}
+		}
+	});
+}
+
+void TerminalCtrl::SaveSnapshotHistory(Stream& out, int begin, int end, Index<dword>& images, Index<dword>& links)
+{
+	LTIMING("TerminalCtrl::SaveSnapshotHistory");
+
+	// The lines are written in chunks, to keep the buffers small.
+
+	for(int i = begin; i < end; i += sChunkLines) {
+		int n = min(sChunkLines, end - i);
+		Vector<VTLine> chunk = dpage.GetLines(i, n);
+		for(const VTLine& line : chunk)
+			SaveSnapshotResources(out, line, images, links);
+		StringStream ss;
+		int64 serial = dpage.GetLineSerial(i);
+		ss % serial;
+		ss / n;
+		for(const VTLine& line : chunk)
+			line.Save(ss);
+		sPutRecord(out, 'H', ss.GetResult());
+	}
+}
+
+void TerminalCtrl::SaveSnapshotState(Stream& out, Index<dword>& images, Index<dword>& links)
+{
+	LTIMING("TerminalCtrl::SaveSnapshotState");
+
+	for(const VTLine& line : apage.GetLines(0, apage.GetLineCount()))
+		SaveSnapshotResources(out, line, images, links);
+	for(const VTLine& line : dpage)
+		SaveSnapshotResources(out, line, images, links);
+
+	StringStream ss;
+	int64 hfirst = 0;
+	int hcount = 0, hstale = 0;
+	SerializeSnapshotState(ss, hfirst, hcount, hstale);
+	sPutRecord(out, 'S', ss.GetResult());
+}
+
+void TerminalCtrl::SaveSnapshot(Stream& out)
+{
+	LTIMING("TerminalCtrl::SaveSnapshot");
+
+	Index<dword> images, links;
+	sPutHeader(out);
+	SaveSnapshotHistory(out, 0, dpage.GetHistoryCount(), images, links);
+	SaveSnapshotState(out, images, links);
+}
+
+bool TerminalCtrl::SaveSnapshot(const char *path)
+{
+	FileOut out(path);
+	if(!out)
+		return false;
+	SaveSnapshot(out);
+	out.Close();
+	return !out.IsError();
+}
+
+bool TerminalCtrl::LoadSnapshot(Stream& in)
+{
+	LTIMING("TerminalCtrl::LoadSnapshot");
+
+	char magic[6];
+	if(!in.GetAll(magic, 6) || memcmp(magic, sMagic, 6) != 0 || in.Get32le() != sVersion) {
+		LLOG("Not a snapshot, or unsupported version.");
+		return false;
+	}
+
+	// Only the record headers are read in this pass. A truncated record (e.g. the writer
+	// was interrupted) ends the snapshot.
+
+	struct Chunk : Moveable<Chunk> {
+		int64   pos;
+		int64   serial;
+		int     count;
+	};
+
+	Vector<Chunk> chunks;
+	VectorMap<dword, int64> imagepos;
+	VectorMap<dword, String> links;
+	int64 state = -1;
+	int64 size = in.GetSize();
+
+	while(!in.IsEof() && !in.IsError()) {
+		int type = in.Get();
+		int len  = in.Get32le();
+		int64 pos = in.GetPos();
+		if(type < 0 || len < 0 || in.IsError() || pos + len > size)
+			break;
+		switch(type) {
+		case 'H': {
+			Chunk& c = chunks.Add();
+			in % c.serial;
+			in / c.count;
+			c.pos = in.GetPos();
+			break;
+		}
+		case 'I': {
+			// Only the ids are read here; the images that the live cells refer to are read
+			// once the state and the history are loaded.
+			dword id = 0;
+			in % id;
+			imagepos.GetAdd(id) = pos;
+			break;
+		}
+		case 'L': {
+			dword id = 0;
+			String data;
+			in % id % data;
+			links.GetAdd(id) = pick(data);
+			break;
+		}
+		case 'S':
+			state = pos;
+			break;
+		default:
+			LLOG("Unknown record type: " << type);
+			break;
+		}
+		in.Seek(pos + len);
+	}
+
+	if(state < 0 || in.IsError()) {
+		LLOG("No valid state record found.");
+		return false;
+	}
+
+	// The current session is set aside first, and restored as is if the snapshot turns out to
+	// be invalid. The history lines are shared, not copied.
+	StringStream backup;
+	int64 bfirst = 0;
+	int bcount = 0, bstale = 0;
+	SerializeSnapshotState(backup, bfirst, bcount, bstale);
+	Vector<VTLine> bhistory;
+	for(const VTLine& line : dpage.GetStaleHistory())
+		bhistory.Add(line);
+	for(const VTLine& line : dpage.GetHistory())
+		bhistory.Add(line);
+
+	CancelSearch();
+
+	VectorMap<dword, String> images;
+	try {
+		in.LoadThrowing();
+		in.Seek(state);
+		int64 hfirst = 0;
+		int hcount = 0, hstale = 0;
+		SerializeSnapshotState(in, hfirst, hcount, hstale);
+		if(hcount < 0 || hstale < 0 || hcount > dpage.GetHistorySize())
+			in.LoadError();
+
+		// The lines of the history are picked from the chunks by their serials. Chunks that
+		// hold no live lines are not even read.
+		Vector<VTLine> history;
+		history.SetCount(hcount);
+		int64 hlast = hfirst + hcount;
+		for(const Chunk& c : chunks) {
+			if(c.serial >= hlast || c.serial + c.count <= hfirst)
+				continue;
+			in.Seek(c.pos);
+			VTLine line;
+			for(int64 serial = c.serial; serial < min(c.serial + c.count, hlast); serial++) {
+				if(!line.Load(in))
+					in.LoadError();
+				if(serial >= hfirst)
+					history[(int)(serial - hfirst)] = pick(line);
+			}
+		}
+		dpage.SetHistory(pick(history), hstale);
+
+		Index<dword> used, usedlinks;
+		dpage.GetResources(used, usedlinks);
+		apage.GetResources(used, usedlinks);
+		for(dword id : used) {
+			int i = imagepos.Find(id);
+			if(i < 0)
+				continue;
+			in.Seek(imagepos[i]);
+			dword rid = 0;
+			String png;
+			in % rid % png;
+			images.Add(id, pick(png));
+		}
+	}
+	catch(LoadingError) {
+		LLOG("Invalid snapshot.");
+		in.NoLoadThrowing();
+		StringStream ss(backup.GetResult());
+		SerializeSnapshotState(ss, bfirst, bcount, bstale);
+		dpage.SetHistory(pick(bhistory), bstale);
+		SwapPage();
+		Refresh();
+		return false;
+	}
+	in.NoLoadThrowing();
+
+	for(int i = 0; i < links.GetCount(); i++) {
+		linksizes.GetAdd(links.GetKey(i)) = links[i].GetLength();
+		GetCachedHyperlink(links.GetKey(i), links[i]);
+	}
+	ReleaseImages(); // The restored cells refer to the restored images only.
+	restoredimages = pick(images);
+
+	SwapPage();
+	Refresh();
+	return true;
+}
+
+bool TerminalCtrl::LoadSnapshot(const char *path)
+{
+	// The file is mapped, so the records that are skipped are never paged in.
+	FileMapping map;
+	if(!map.Open(path) || !map.Map(0, map.GetFileSize()))
+		return false;
+	MemReadStream in(map.Begin(), map.GetCount());
+	return LoadSnapshot(in);
+}
+
+VTSnapshotWriter::VTSnapshotWriter()
+: term(nullptr)
+, next(0)
+, written(0)
+, states(0)
+, generation(0)
+, restarted(false)
+, error(false)
+{
+}
+
+VTSnapshotWriter::~VTSnapshotWriter()
+{
+	Close();
+}
+
+bool VTSnapshotWriter::Open(const char *p)
+{
+	Close();
+	path = p;
+	error = false;
+	term = nullptr;
+	return true;
+}
+
+void VTSnapshotWriter::Close()
+{
+	if(out.IsOpen())
+		out.Close();
+	images.Clear();
+	links.Clear();
+	term = nullptr;
+}
+
+bool VTSnapshotWriter::Restart(TerminalCtrl& t)
+{
+	LLOG("Restart: " << path);
+
+	// The snapshot is rewritten into a temporary file, which replaces the old one only once it
+	// holds a complete snapshot (see Write()). Thus a crash during the rewrite loses nothing.
+	if(out.IsOpen())
+		out.Close();
+	if(!out.Open(path + ".tmp", FileStream::CREATE)) {
+		error = true;
+		return false;
+	}
+	restarted  = true;
+	sPutHeader(out);
+	images.Clear();
+	links.Clear();
+	term       = &t;
+	next       = t.dpage.GetLineSerial(0);
+	written    = 0;
+	states     = 0;
+	generation = t.dpage.GetHistoryGeneration();
+	return true;
+}
+
+bool VTSnapshotWriter::Write(TerminalCtrl& t)
+{
+	LTIMING("VTSnapshotWriter::Write");
+
+	if(IsNull(path))
+		return false;
+
+	VTPage& page = t.dpage;
+	int64 first = page.GetLineSerial(0);
+	int count = page.GetHistoryCount();
+
+	if(!out.IsOpen()
+	|| term != &t
+	|| generation != page.GetHistoryGeneration()
+	|| written - count > max(count, 4096)
+	|| states >= 1024)
+		if(!Restart(t))
+			return false;
+
+	// The lines that were dropped before they were written are simply lost.
+	int begin = (int) clamp<int64>(next - first, 0, count);
+	t.SaveSnapshotHistory(out, begin, count, images, links);
+	t.SaveSnapshotState(out, images, links);
+	written += count - begin;
+	next = first + count;
+	states++;
+
+	out.Flush();
+	if(out.IsError()) {
+		LLOG("Write error.");
+		error = true;
+	}
+	else
+	if(restarted) {
+		out.Close();
+		String tmp = path + ".tmp";
+#ifdef PLATFORM_WIN32
+		FileDelete(path); // MoveFile() does not replace files.
+#endif
+		if(!FileMove(tmp, path) || !out.Open(path, FileStream::APPEND)) {
+			LLOG("Unable to replace the snapshot.");
+			error = true;
+		}
+		restarted = false;
+	}
+	return !error;
+}
+
+}
@@ -0,0 +1,56 @@
+#ifndef _VTSnapshot_h_
+#define _VTSnapshot_h_
+
+#include <Core/Core.h>
+
+namespace Upp {
+
+class TerminalCtrl;
+
+// Session snapshots. A snapshot starts with a header, followed by records. Each record is a
+// type byte, the length of its payload (32-bit LE) and the payload:
+//
+//   'H': History lines: The serial of the first line (int64), the line count, the lines.
+//   'I': Inline image: id, PNG data.
+//   'L': Hyperlink: id, URI.
+//   'S': The state of the terminal and its pages, without the history of the main page.
+//
+// A snapshot can hold several history and state records, as the writer appends them as the
+// session goes on. The last state record wins, and the history records are matched to it by
+// the serials of their lines, so the loader can skip (seek over) everything else. The lines
+// are decoded as packed lines, which are expanded only when they are displayed.
+
+class VTSnapshotWriter : NoCopy {
+public:
+    VTSnapshotWriter();
+    virtual ~VTSnapshotWriter();
+
+    // Appends the history lines, images and hyperlinks that are not in the file yet, then the
+    // current state of the terminal. The file is rewritten from scratch if the history has
+    // been modified since the last write (e.g. reflowed), or if the file holds too many lines
+    // that are no longer in the history. A rewritten file replaces the old one only when it is
+    // complete.
+    bool            Open(const char *path);
+    bool            Write(TerminalCtrl& t);
+    void            Close();
+    bool            IsOpen() const                  { return out.IsOpen(); }
+    bool            IsError() const                 { return error; }
+
+private:
+    bool            Restart(TerminalCtrl& t);
+
+    FileStream      out;
+    String          path;
+    Index<dword>    images;
+    Index<dword>    links;
+    TerminalCtrl   *term;
+    int64           next;                           // The serial of the next history line to write.
+    int64           written;                        // The history lines written since the restart.
+    int             states;                         // The state records written since the restart.
+    dword           generation;
+    bool            restarted;                      // Writing to the temporary file.
+    bool            error;
+};
+
+}
+#endif
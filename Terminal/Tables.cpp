@@ -5,12 +5,65 @@
 
 namespace Upp {
 
+// The dispatch tables are built at compile time. Control functions are indexed directly by
+// the control byte, while escape sequences, command sequences, device control strings and
+// modes are sorted by their keys and looked up with a binary search. Each entry carries a
+// bit mask of the conformance levels it is available at.
+
+static constexpr byte sLevelMask(int minlevel, int maxlevel)
+{
+    return byte(((1 << (maxlevel + 1)) - 1) & ~((1 << minlevel) - 1));
+}
+
+template <class T>
+struct VTControlTable {
+    T   cb[256];
+
+    template <int N>
+    constexpr VTControlTable(const T (&list)[N]) : cb{}
+    {
+        for(int i = N - 1; i >= 0; i--)
+            cb[list[i].key] = list[i];
+    }
+
+    const T* Find(byte c) const                                 { return cb[c].fn ? &cb[c] : nullptr; }
+};
+
+template <class T, int N>
+struct VTSortedTable {
+    T   cb[N];
+
+    constexpr VTSortedTable(const T (&list)[N]) : cb{}
+    {
+        for(int i = 0; i < N; i++) { // Insertion sort. Keeps the first of duplicate keys first.
+            int j = i;
+            for(; j > 0 && list[i].key < cb[j - 1].key; j--)
+                cb[j] = cb[j - 1];
+            cb[j] = list[i];
+        }
+    }
+
+    const T* Find(dword key) const
+    {
+        int lo = 0, hi = N;
+        while(lo < hi) {
+            int m = (lo + hi) >> 1;
+            if(cb[m].key < key)
+                lo = m + 1;
+            else
+                hi = m;
+        }
+        return lo < N && cb[lo].key == key ? cb + lo : nullptr;
+    }
+};
+
 void TerminalCtrl::DispatchCtl(byte ctl)
 {
-    #define VT_CTL(cbyte, minlevel, maxlevel, fn)                           \
-    {                                                                       \
-        { cbyte },                                                          \
-        { TerminalCtrl::minlevel, TerminalCtrl::maxlevel, [](TerminalCtrl& t, byte c) fn } \
+    #define VT_CTL(cbyte, minlevel, maxlevel, fn)                                            \
+    {                                                                                        \
+        cbyte,                                                                               \
+        sLevelMask(TerminalCtrl::minlevel, TerminalCtrl::maxlevel),                          \
+        [](TerminalCtrl& t, byte c) fn                                                       \
     }
 
     LLOG(Format("CTL 0x%02X (C%[1:0;1]s`)", ctl, ctl < 0x80));
@@ -21,10 +74,7 @@ void TerminalCtrl::DispatchCtl(byte ctl)
         return;
     }
 
-    static VectorMap<dword, CbControl> vtcbytes;
-    
-    ONCELOCK {
-    vtcbytes = {
+    static constexpr CbControl vtcbytes[] = {
         VT_CTL(0x00,   LEVEL_0, LEVEL_4, { /* NOP */                                              }),   // NUL:   Ignored
         VT_CTL(0x05,   LEVEL_0, LEVEL_4, { t.Put(t.answerback.ToWString());                       }),   // ENQ:   Terminal status request
         VT_CTL(0x07,   LEVEL_0, LEVEL_4, { t.WhenBell();                                          }),   // BEL:   Audio or visual bell
@@ -49,32 +99,31 @@ void TerminalCtrl::DispatchCtl(byte ctl)
         VT_CTL(0x97,   LEVEL_2, LEVEL_4, { t.SetISOStyleCellProtection(false);                    }),   // EPA:   End of protected area
         VT_CTL(0x9A,   LEVEL_1, LEVEL_4, { t.ReportDeviceAttributes(VTInStream::Sequence());      }),   // DECID: Report terminal ID
         VT_CTL(0x9C,   LEVEL_1, LEVEL_4, { /* NOP */                                              })    // ST:    String terminator
-        };
-    }
-    
+    };
+
     #undef VT_CTL
-    
-    const CbControl *p = vtcbytes.FindPtr(ctl);
-    if(p && clevel >= p->a && clevel <= p->b)
-        p->c(*this, ctl);
+
+    static constexpr VTControlTable<CbControl> vtctltable(vtcbytes);
+
+    const CbControl *p = vtctltable.Find(ctl);
+    if(p && (p->levels & (1 << clevel)))
+        p->fn(*this, ctl);
 }
 
 const TerminalCtrl::CbFunction* TerminalCtrl::FindFunctionPtr(const VTInStream::Sequence& seq)
 {
     #define VT_SEQUENCE(seq, opcode, mode, interm1, interm2, minlevel, maxlevel, fn)       \
     {                                                                                      \
-        { VTInStream::Hash32(VTInStream::Sequence::seq, opcode, mode, interm1, interm2) },  \
-        { TerminalCtrl::minlevel, TerminalCtrl::maxlevel, [](TerminalCtrl& t, const VTInStream::Sequence& q) fn }   \
+        VTInStream::Hash32(VTInStream::Sequence::seq, opcode, mode, interm1, interm2),      \
+        sLevelMask(TerminalCtrl::minlevel, TerminalCtrl::maxlevel),                        \
+        [](TerminalCtrl& t, const VTInStream::Sequence& q) fn                              \
     }
     
     #define VT_ESC(opcode, mode, interm1, interm2, minlevel, maxlevel, fn)  VT_SEQUENCE(ESC, opcode, mode, interm1, interm2, minlevel, maxlevel, fn)
     #define VT_CSI(opcode, mode, interm1, interm2, minlevel, maxlevel, fn)  VT_SEQUENCE(CSI, opcode, mode, interm1, interm2, minlevel, maxlevel, fn)
     #define VT_DCS(opcode, mode, interm1, interm2, minlevel, maxlevel, fn)  VT_SEQUENCE(DCS, opcode, mode, interm1, interm2, minlevel, maxlevel, fn)
 
-    static VectorMap<dword, CbFunction> vtsequences;
-    
-    ONCELOCK {
-    vtsequences = {
+    static constexpr CbFunction vtsequences[] = {
         // Escape sequences
         VT_ESC('6', 0x00, 0x00, 0x00, LEVEL_4, LEVEL_4,  { t.page->PrevColumn();                                        }),   // DECBI:   Back index
         VT_ESC('7', 0x00, 0x00, 0x00, LEVEL_1, LEVEL_4,  { t.Backup();                                                  }),   // DECSC:   Save cursor
@@ -213,7 +262,6 @@ const TerminalCtrl::CbFunction* TerminalCtrl::FindFunctionPtr(const VTInStream::
         VT_DCS('t', 0x00, '$',  0x00, LEVEL_3, LEVEL_4,  { t.RestorePresentationState(q);                               }),   // DECRSPS:  Restore presentation state
         VT_DCS('|', 0x00, 0x00, 0x00, LEVEL_2, LEVEL_4,  { t.SetUserDefinedKeys(q);                                     })    // DECUDK:   Set user-defined keys
     };
-    }
 
     #undef VT_ESC
     #undef VT_CSI
@@ -222,8 +270,10 @@ const TerminalCtrl::CbFunction* TerminalCtrl::FindFunctionPtr(const VTInStream::
     
     LTIMING("TerminalCtrl::FındFunctionPtr");
 
-    const CbFunction *p = vtsequences.FindPtr(seq.GetHashValue());
-    if(p && clevel >= p->a && clevel <= p->b)
+    static constexpr VTSortedTable<CbFunction, __countof(vtsequences)> vtseqtable(vtsequences);
+
+    const CbFunction *p = vtseqtable.Find(seq.GetHashValue());
+    if(p && (p->levels & (1 << clevel)))
         return p;
     
     LLOG(decode(seq.type,
@@ -236,16 +286,15 @@ const TerminalCtrl::CbFunction* TerminalCtrl::FindFunctionPtr(const VTInStream::
 
 const TerminalCtrl::CbMode* TerminalCtrl::FindModePtr(word modenum, byte modetype)
 {
-    #define VT_MODE(id, mode, type, minlevel, maxlevel, fn)        \
-    {                                                              \
-        { MAKELONG(mode, type) },                                  \
-        { id, TerminalCtrl::minlevel, TerminalCtrl::maxlevel, [](TerminalCtrl& t, int n, bool b) fn  }   \
+    #define VT_MODE(id, mode, type, minlevel, maxlevel, fn)              \
+    {                                                                    \
+        MAKELONG(mode, type),                                            \
+        id,                                                              \
+        sLevelMask(TerminalCtrl::minlevel, TerminalCtrl::maxlevel),      \
+        [](TerminalCtrl& t, int n, bool b) fn                            \
     }
 
-    static VectorMap<dword, CbMode> vtmodes;
-
-    ONCELOCK {
-    vtmodes = {
+    static constexpr CbMode vtmodes[] = {
         // ANSI modes
         VT_MODE(GATM,       1,      0x00,   LEVEL_1, LEVEL_4,  { /* NOP */       }),    // Permanently reset
         VT_MODE(KAM,        2,      0x00,   LEVEL_1, LEVEL_4,  { t.ANSIkam(b);   }),    // Keyboard action mode
@@ -298,13 +347,14 @@ const TerminalCtrl::CbMode* TerminalCtrl::FindModePtr(word modenum, byte modetyp
         VT_MODE(XTSPREG,    1070,   '?',    LEVEL_1, LEVEL_4,  { /* NOP */       }),    // Use private color registers for each sixel (permanently set)
         VT_MODE(XTBRPM,     2004,   '?',    LEVEL_1, LEVEL_4,  { t.XTbrpm(b);    })     // Bracketed paste mode
     };
-    }
-    
+
     #undef VT_MODE
     
     LTIMING("TerminalCtrl::FındModePtr");
      
-    const CbMode *p = vtmodes.FindPtr(MAKELONG(modenum, modetype));
-    return (p && clevel >= p->b && clevel <= p->c) ? p : nullptr;
+    static constexpr VTSortedTable<CbMode, __countof(vtmodes)> vtmodetable(vtmodes);
+
+    const CbMode *p = vtmodetable.Find(MAKELONG(modenum, modetype));
+    return (p && (p->levels & (1 << clevel))) ? p : nullptr;
 }
 }
@@ -14,6 +14,8 @@ TerminalCtrl::TerminalCtrl()
 , sixelimages(false)
 , jexerimages(false)
 , iterm2images(false)
+, kittyimages(false)
+, kittyfiles(false)
 , hyperlinks(false)
 , reversewrap(false)
 , hidemousecursor(false)
@@ -47,14 +49,19 @@ TerminalCtrl::TerminalCtrl()
 	caret.WhenAction = [=, this]() { ScheduleRefresh(); };
 	dpage.WhenUpdate = [=, this]() { ScheduleRefresh(); };
 	apage.WhenUpdate = [=, this]() { ScheduleRefresh(); };
+	AttachMemoryBudget();
 }
 
 TerminalCtrl::~TerminalCtrl()
 {
 	// Make sure that no callback is left dangling...
+	DetachMemoryBudget();
+	CancelSearch();
+	ReleaseImages();
 	KillTimeCallback(TIMEID_REFRESH);
 	KillTimeCallback(TIMEID_SIZEHINT);
 	KillTimeCallback(TIMEID_BLINK);
+	KillTimeCallback(TIMEID_SEARCH);
 }
 
 TerminalCtrl& TerminalCtrl::SetFont(Font f)
@@ -161,6 +168,24 @@ String TerminalCtrl::GetSelectionData(const String& fmt) const
 	return IsSelection() ? GetTextClip(GetSelectedText().ToString(), fmt) : Null;
 }
 
+bool TerminalCtrl::ExportSelection(Stream& out, int fmt) const
+{
+	return IsSelection()
+		&& VTExporter().Format(fmt).RectSelection(seltype == SEL_RECT).Export(*page, GetSelectionRect(), out);
+}
+
+bool TerminalCtrl::Export(Stream& out, int fmt, bool history) const
+{
+	int n = page->GetLineCount();
+	int y = history ? 0 : n - page->GetSize().cy;
+	return VTExporter().Format(fmt).Export(*page, Rect(0, y, page->GetSize().cx, n - 1), out);
+}
+
+String TerminalCtrl::GetHtmlStyleSheet() const
+{
+	return VTExporter::GetStyleSheet(colortable, colortable[COLOR_INK], colortable[COLOR_PAPER]);
+}
+
 void TerminalCtrl::SyncSize(bool notify)
 {
 	// Apparently, the window minimize event on Windows "really" minimizes
@@ -186,6 +211,10 @@ void TerminalCtrl::SyncSize(bool notify)
 	
 	if(resizing && newsize.cx > 1 && 1 < newsize.cy) {
 		page->SetSize(newsize);
+		if(page->IsReflowing())
+			ClearFind(); // The lines are renumbered.
+		if(recorder)
+			recorder->Resize(newsize);
 		if(notify) {
 			if(sizehint) {
 				hinting = true;
@@ -256,6 +285,18 @@ void TerminalCtrl::Scroll()
 	if(IsAlternatePage())
 		return;
 
+	if(page->HasStaleHistory()) {
+		// The history lines that predate a width change are rewrapped as they come into view.
+		int pos = sb.GetTotal() - sb;
+		if(page->RewrapHistory(pos + page->GetSize().cy)) {
+			int total = page->GetLineCount();
+			sb.SetTotal(total);
+			sb.Set(total - pos);
+			ClearSelection();
+			ClearFind();
+		}
+	}
+
 	Refresh();
 	PlaceCaret();
 }
@@ -265,6 +306,7 @@ void TerminalCtrl::SwapPage()
 	SyncSize(false);
 	SyncSb();
 	ClearSelection();
+	ClearFind();
 }
 
 void TerminalCtrl::RefreshDisplay()
@@ -739,6 +781,248 @@ void TerminalCtrl::ClearSelection()
 	Refresh();
 }
 
+int TerminalCtrl::Find(const WString& s, bool ignorecase)
+{
+	CancelSearch();
+	page->UpdateIndex();
+	matches = page->Find(s, ignorecase);
+	matchindex = -1;
+	Refresh();
+	return matches.GetCount();
+}
+
+bool TerminalCtrl::FindNext()
+{
+	// Without a current match, the search starts from the oldest (FindNext) or the most
+	// recent (FindPrev) match.
+	if(matches.IsEmpty())
+		return false;
+	return ShowMatch(matchindex < 0 ? 0 : (matchindex + 1) % matches.GetCount());
+}
+
+bool TerminalCtrl::FindPrev()
+{
+	if(matches.IsEmpty())
+		return false;
+	int n = matches.GetCount();
+	return ShowMatch(matchindex < 0 ? n - 1 : (matchindex + n - 1) % n);
+}
+
+void TerminalCtrl::ClearFind()
+{
+	CancelSearch();
+	if(matches.IsEmpty())
+		return;
+	matches.Clear();
+	matchindex = -1;
+	Refresh();
+}
+
+bool TerminalCtrl::SearchAsync(const String& pattern, bool ignorecase)
+{
+	CancelSearch();
+
+	int options = RegExp::UNICODE | (ignorecase ? RegExp::CASELESS : 0);
+	RegExp re(pattern, options);
+	if(pattern.IsEmpty() || re.IsError()) {
+		LLOG("SearchAsync(): invalid pattern: " << pattern);
+		return false;
+	}
+
+	matches.Clear();
+	matchindex = -1;
+	Refresh();
+
+	// The workers search a snapshot of the buffer. Its lines share their cells with the page
+	// and the history, which detach them on modification, so the snapshot stays immutable.
+	// The matches refer to the line serials, so they stay valid as the lines scroll away.
+	int n = page->GetLineCount();
+	searchlines = page->GetLines(0, n);
+	searchclusters = page->GetClusters();
+	searchbase = page->GetLineSerial(0);
+
+	int id = ++searchid;
+	int chunk = max(1024, n / (4 * CPU_Cores()) + 1);
+	for(int b = 0; b < n; b += chunk) {
+		int e = min(n, b + chunk);
+		searchpending++;
+		searchwork & [=, this] { SearchRange(id, pattern, options, b, e); };
+	}
+	return true;
+}
+
+void TerminalCtrl::CancelSearch()
+{
+	searchid++;
+	searchwork.Cancel(); // Waits for the running jobs.
+	searchpending = 0;
+	searchlines.Clear();
+	searchclusters.Clear();
+	Mutex::Lock __(searchlock);
+	searchfound.Clear();
+	searchdone = 0;
+}
+
+void TerminalCtrl::SearchRange(int id, const String& pattern, int options, int begin, int end)
+{
+	LTIMING("TerminalCtrl::SearchRange");
+
+	// Searches the logical lines that begin in the [begin, end) range. The last one can
+	// extend beyond the range.
+
+	RegExp re(pattern, options);
+	const Vector<VTLine>& lines = searchlines;
+	int n = lines.GetCount();
+
+	Vector<VTMatch> found;
+	WString text;
+	Vector<Point> cells;
+	Vector<int>   ends, offsets;
+
+	int i = begin;
+	while(i > 0 && i < end && lines[i - 1].IsWrapped())
+		i++;
+
+	while(i < end && !CoWork::IsCanceled() && searchid == id) {
+		text.Clear();
+		cells.Clear();
+		ends.Clear();
+		offsets.Clear();
+		int bytes = 0;
+		int j = i;
+		for(;; j++) {
+			int x = 0;
+			auto Put = [&](dword c, int width) {
+				text.Cat((int) c);
+				cells.Add(Point(x, j));
+				ends.Add(x + max(1, width));
+				offsets.Add(bytes);
+				bytes += c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+			};
+			lines[j].Visit([&](const VTCell& cell) {
+				if(cell.chr == 0 || cell.IsImage())
+					Put(' ', 1);
+				else
+				if(cell.IsCluster()) {
+					int k = cell.chr & VTCell::CLUSTER_MASK;
+					if(k < searchclusters.GetCount() && searchclusters[k].GetCount())
+						for(int c : searchclusters[k])
+							Put(c, cell.GetWidth());
+					else
+						Put(0xFFFD, cell.GetWidth());
+				}
+				else
+				if(cell.chr != 1) // The second half of a wide character has no text.
+					Put(cell.chr, cell.GetWidth());
+				x++;
+			});
+			if(!lines[j].IsWrapped() || j + 1 >= n)
+				break;
+		}
+		String s = ToUtf8(text);
+		for(int pos = 0; pos < s.GetLength() && re.Execute(s, pos) > 0;) {
+			int o = re.GetOffset(), l = re.GetLength();
+			if(l <= 0) { // Empty matches are skipped.
+				pos = o + 1;
+				continue;
+			}
+			int a = FindUpperBound(offsets, o) - 1;
+			int z = FindUpperBound(offsets, o + l - 1) - 1;
+			VTMatch& m = found.Add();
+			m.line    = searchbase + cells[a].y;
+			m.col     = cells[a].x;
+			m.endline = searchbase + cells[z].y;
+			m.endcol  = ends[z];
+			pos = o + l;
+		}
+		if(found.GetCount() >= 256)
+			PostSearch(id, found);
+		i = j + 1;
+	}
+
+	PostSearch(id, found, true);
+}
+
+void TerminalCtrl::PostSearch(int id, Vector<VTMatch>& found, bool last)
+{
+	// Called by the workers. The results are collected and passed to the GUI thread. The jobs
+	// are counted as finished only when their last batch is delivered (see FlushSearch()).
+	{
+		Mutex::Lock __(searchlock);
+		if(searchid != id)
+			return;
+		searchfound.AppendPick(pick(found));
+		found.Clear();
+		if(last)
+			searchdone++;
+	}
+	KillSetTimeCallback(0, [=, this] { if(searchid == id) FlushSearch(); }, TIMEID_SEARCH);
+}
+
+void TerminalCtrl::FlushSearch()
+{
+	Vector<VTMatch> v;
+	int done = 0;
+	{
+		Mutex::Lock __(searchlock);
+		v = pick(searchfound);
+		searchfound.Clear();
+		done = searchdone;
+		searchdone = 0;
+	}
+
+	if(v.GetCount()) {
+		// The matches arrive out of order, and matchindex must follow the current match.
+		int64 line = -1;
+		int   col  = 0;
+		if(matchindex >= 0) {
+			line = matches[matchindex].line;
+			col  = matches[matchindex].col;
+		}
+		matches.AppendPick(pick(v));
+		Sort(matches, [](const VTMatch& a, const VTMatch& b) {
+			return a.line < b.line || (a.line == b.line && a.col < b.col);
+		});
+		if(line >= 0)
+			matchindex = GetMatchAt(line, col);
+		Refresh();
+	}
+
+	searchpending -= done;
+	if(searchpending == 0) {
+		searchlines.Clear();
+		searchclusters.Clear();
+	}
+
+	WhenSearch();
+}
+
+bool TerminalCtrl::ShowMatch(int i)
+{
+	int y = page->GetLineIndex(matches[i].line);
+	if(y < 0 || y >= page->GetLineCount())
+		return false; // The line has been dropped from the history.
+	matchindex = i;
+	sb.ScrollInto(y);
+	Refresh();
+	return true;
+}
+
+int TerminalCtrl::GetMatchAt(int64 serial, int col) const
+{
+	// The matches are sorted and don't overlap.
+	int lo = 0, hi = matches.GetCount();
+	while(lo < hi) {
+		int m = (lo + hi) / 2;
+		const VTMatch& x = matches[m];
+		if(x.endline < serial || (x.endline == serial && x.endcol <= col))
+			lo = m + 1;
+		else
+			hi = m;
+	}
+	return lo < matches.GetCount() && matches[lo].Contains(serial, col) ? lo : -1;
+}
+
 bool TerminalCtrl::IsSelected(Point pt) const
 {
 	Point pl, ph;
@@ -795,7 +1079,7 @@ bool TerminalCtrl::GetWordSelection(const Point& pt, Point& pl, Point& ph) const
 
 	const VTLine& line = page->FetchLine(pt.y);
 	if(!line.IsVoid()) {
-		const VTCell& cell = line[pt.x];
+		const VTCell& cell = line.Get(pt.x, VTCell::Void());
 		if(!cell.IsImage() && (cell.chr == 1 || cell.chr >= 32)) {
 			ph.x++;
 			if(IsLeNum(cell.chr) || cell.chr == '_') {
@@ -855,9 +1139,9 @@ Image TerminalCtrl::GetInlineImage(Point pt, bool modifier)
 	if(modifier) {
 		const VTCell& cell = page->FetchCell(pt);
 		if(cell.IsImage()) {
-			Image img = GetCachedImageData(cell.chr, Null, GetCellSize()).image;
-			if(!IsNull(img))
-				return pick(img);
+			const VTImageStore::Entry *e = GetImageEntry(cell.chr);
+			if(e && !IsNull(e->image))
+				return e->image;
 			LLOG("Unable to retrieve image from cache. Link id: " << cell.chr);
 		}
 	}
@@ -962,7 +1246,7 @@ void TerminalCtrl::ImagesBar(Bar& menu)
 
 void TerminalCtrl::OptionsBar(Bar& menu)
 {
-	bool inlineimages = jexerimages || sixelimages || iterm2images;
+	bool inlineimages = HasInlineImages();
 
 	menu.Sub(t_("Стиль курсора"), [=, this](Bar& menu)
 		{
@@ -3,10 +3,16 @@
 
 #include <CtrlLib/CtrlLib.h>
 #include <plugin/jpg/jpg.h>
+#include <plugin/pcre/pcre.h>
 
 #include "Parser.h"
 #include "Page.h"
+#include "Export.h"
 #include "Sixel.h"
+#include "ImageStore.h"
+#include "Base64.h"
+#include "Recorder.h"
+#include "Snapshot.h"
 
 namespace Upp {
 
@@ -62,6 +68,8 @@ public:
         TIMEID_REFRESH = Ctrl::TIMEID_COUNT,
         TIMEID_SIZEHINT,
         TIMEID_BLINK,
+        TIMEID_SEARCH,
+        TIMEID_IMAGES,
         TIMEID_COUNT
     };
 
@@ -97,10 +105,17 @@ public:
     // APC support.
     Event<const String&> WhenApplicationCommand;
 
+    // Background search support.
+    Event<>              WhenSearch;
+
     void            Write(const void *data, int size, bool utf8 = true);
     void            Write(const String& s, bool utf8 = true)        { Write(~s, s.GetLength(), utf8); }
     void            WriteUtf8(const String& s)                      { Write(s, true);         }
 
+    TerminalCtrl&   Record(VTRecorder& r)                           { recorder = &r; return *this; }
+    TerminalCtrl&   StopRecording()                                 { recorder = nullptr; return *this; }
+    bool            IsRecording() const                             { return recorder && recorder->IsOpen(); }
+
     TerminalCtrl&   Echo(const String& s);
     
     TerminalCtrl&   SetLevel(int level)                             { SetEmulation(level); return *this; }
@@ -125,6 +140,11 @@ public:
     TerminalCtrl&   ClearHistory()                                  { dpage.EraseHistory(); return *this; }
     bool            HasHistory() const                              { return dpage.HasHistory(); }
 
+    // Off by default. The alternate page is never reflowed.
+    TerminalCtrl&   Reflow(bool b = true)                           { dpage.Reflow(b); return *this; }
+    TerminalCtrl&   NoReflow()                                      { return Reflow(false); }
+    bool            IsReflowing() const                             { return dpage.IsReflowing(); }
+
     TerminalCtrl&   SetHistorySize(int sz)                          { dpage.SetHistorySize(sz); return *this; }
     int             GetHistorySize() const                          { return dpage.GetHistorySize(); }
 
@@ -214,6 +234,13 @@ public:
     TerminalCtrl&   NoInlineImages()                                { return InlineImages(false);  }
     bool            HasInlineImages() const                         { return sixelimages || jexerimages || iterm2images; }
 
+    // Images whose size can be read from their headers are decoded by worker threads, while
+    // their cells are reserved with placeholders. At most 'n' images are queued per terminal;
+    // the rest are decoded synchronously. Zero disables asynchronous decoding.
+    TerminalCtrl&   AsyncImageDecoding(int n = 16)                  { maximagejobs = max(n, 0); return *this; }
+    TerminalCtrl&   NoAsyncImageDecoding()                          { return AsyncImageDecoding(0); }
+    bool            IsDecodingImagesAsync() const                   { return maximagejobs > 0; }
+
     TerminalCtrl&   SixelGraphics(bool b = true)                    { sixelimages = b; return *this; }
     TerminalCtrl&   NoSixelGraphics()                               { return SixelGraphics(false); }
     bool            HasSixelGraphics() const                        { return sixelimages; }
@@ -226,6 +253,17 @@ public:
     TerminalCtrl&   NoiTerm2Graphics(bool b = true)                 { return iTerm2Graphics(false); }
     bool            HasiTerm2Graphics() const                       { return iterm2images; }
 
+    // Kitty graphics protocol (APC _G). Not enabled by InlineImages(). The file and shared
+    // memory transmission media let the client make the terminal read local files and shared
+    // memory objects, so they need to be enabled separately, and only for trusted clients.
+    TerminalCtrl&   KittyGraphics(bool b = true)                    { kittyimages = b; return *this; }
+    TerminalCtrl&   NoKittyGraphics()                               { return KittyGraphics(false); }
+    bool            HasKittyGraphics() const                        { return kittyimages; }
+
+    TerminalCtrl&   KittyGraphicsFileAccess(bool b = true)          { kittyfiles = b; return *this; }
+    TerminalCtrl&   NoKittyGraphicsFileAccess()                     { return KittyGraphicsFileAccess(false); }
+    bool            HasKittyGraphicsFileAccess() const              { return kittyfiles; }
+
     TerminalCtrl&   Hyperlinks(bool b = true)                       { hyperlinks = b; return *this; }
     TerminalCtrl&   NoHyperlinks()                                  { return Hyperlinks(false);     }
     bool            HasHyperlinks() const                           { return hyperlinks; }
@@ -298,7 +336,27 @@ public:
     void            SelectAll(bool history = false);
     bool            IsSelection() const                             { return !IsNull(anchor) && anchor != selpos && seltype != SEL_NONE; }
 
+    int             Find(const WString& s, bool ignorecase = true);
+    bool            FindNext();
+    bool            FindPrev();
+    void            ClearFind();
+    int             GetFindCount() const                            { return matches.GetCount(); }
+    const Vector<VTMatch>& GetMatches() const                       { return matches; }
+
+    // Regular expression search over the whole buffer, run by worker threads. The matches
+    // are merged into GetMatches() as they are found, and WhenSearch is called for each
+    // batch. Returns false if the pattern is invalid.
+    bool            SearchAsync(const String& pattern, bool ignorecase = true);
+    void            CancelSearch();
+    bool            IsSearching() const                             { return searchpending > 0; }
+
     String          GetSelectionData(const String& fmt) const override;
+
+    // Streams the selection, or the page (optionally with its history), in the given
+    // VTExportFormat. See also GetHtmlStyleSheet().
+    bool            ExportSelection(Stream& out, int fmt = VTEXPORT_TEXT) const;
+    bool            Export(Stream& out, int fmt = VTEXPORT_TEXT, bool history = true) const;
+    String          GetHtmlStyleSheet() const;
     
     void            StdBar(Bar& menu);
     void            EditBar(Bar& menu);
@@ -364,12 +422,66 @@ public:
     void            Jsonize(JsonIO& jio) override;
     void            Xmlize(XmlIO& xio) override;
 
+    // Session snapshots: Unlike Serialize(), these store the complete state of the emulator,
+    // including both pages, the history, the modes, and the images and hyperlinks that the
+    // cells refer to. An invalid snapshot leaves the terminal as it was. See also
+    // VTSnapshotWriter.
+    void            SaveSnapshot(Stream& out);
+    bool            LoadSnapshot(Stream& in);
+    bool            SaveSnapshot(const char *path);
+    bool            LoadSnapshot(const char *path);
+
     static void     ClearImageCache();
     static void     SetImageCacheMaxSize(int maxsize, int maxcount);
 
     static void     ClearHyperlinkCache();
     static void     SetHyperlinkCacheMaxSize(int maxcount);
 
+    // Memory accounting. The images and the hyperlinks are kept in process-wide caches, so
+    // their usage is the size of the cache entries that the terminal's cells refer to.
+    struct MemoryUsage : Moveable<MemoryUsage> {
+        int64       page    = 0;                            // Both pages, without their history.
+        int64       history = 0;
+        int64       images  = 0;
+        int64       links   = 0;
+        int64       GetTotal() const                        { return page + history + images + links; }
+    };
+
+    MemoryUsage     GetMemoryUsage() const;
+    int64           GetLastViewTime() const                         { return lastviewed; }
+
+    // Compresses the history and, if 'trim' is true, drops its oldest lines until at least
+    // 'bytes' are freed. A page worth of history is always kept. Returns the freed bytes.
+    int64           ReleaseMemory(int64 bytes, bool trim = true);
+
+    // Process-wide memory budget: When the total usage of the terminals exceeds the budget,
+    // the history of the least recently viewed terminals is compressed first, then trimmed.
+    // The budget is checked periodically, every 'interval' ms. Zero disables the budget.
+    static void     SetMemoryBudget(int64 bytes, int interval = 2000);
+    static int64    GetMemoryBudget();
+    static int64    GetTotalMemoryUsage();
+    static void     EnforceMemoryBudget();
+
+private:
+    void        AttachMemoryBudget();
+    void        DetachMemoryBudget();
+    int64       PruneResources();
+
+    VectorMap<dword, VTImageStore::Entry*> inlineimages;    // Referenced. See GetImageId().
+    int         imagecount      = 0;                        // After the last pruning.
+    VectorMap<dword, int> linksizes;
+    int64       lastviewed      = 0;
+
+private:
+    friend class VTSnapshotWriter;
+
+    void        SerializeSnapshotState(Stream& s, int64& hfirst, int& hcount, int& hstale);
+    void        SaveSnapshotHistory(Stream& out, int begin, int end, Index<dword>& images, Index<dword>& links);
+    void        SaveSnapshotState(Stream& out, Index<dword>& images, Index<dword>& links);
+    void        SaveSnapshotResources(Stream& out, const VTLine& line, Index<dword>& images, Index<dword>& links);
+
+    VectorMap<dword, String> restoredimages;                // PNG data, decoded on demand.
+
 private:
     void        InitParser(VTInStream& vts);
     
@@ -406,6 +518,11 @@ private:
     Rect        GetSelectionRect() const;
     void        ClearSelection();
     bool        IsSelected(Point pt) const;
+    int         GetMatchAt(int64 serial, int col) const;
+    bool        ShowMatch(int i);
+    void        SearchRange(int id, const String& pattern, int options, int begin, int end);
+    void        PostSearch(int id, Vector<VTMatch>& found, bool last = false);
+    void        FlushSearch();
     WString     GetSelectedText() const;
     void        GetLineSelection(const Point& pt, Point& pl, Point& ph) const;
     bool        GetWordSelection(const Point& pt, Point& pl, Point& ph) const;
@@ -439,20 +556,6 @@ private:
         ImageString(String&& s)                                 { SetNull(); data = s;  }
     };
 
-    struct InlineImageMaker : LRUCache<InlineImage>::Maker {
-        dword   id;
-        const   Size& fontsize;
-        const   ImageString& imgs;
-        String  Key() const override;
-        int     Make(InlineImage& imagedata) const override;
-        InlineImageMaker(int i, const ImageString& s, const Size& sz)
-        : id(i)
-        , imgs(s)
-        , fontsize(sz)
-        {
-        }
-    };
-
     struct HyperlinkMaker : LRUCache<String>::Maker {
         dword   id;
         const   String& url;
@@ -470,7 +573,83 @@ private:
     void        PaintImages(Draw& w, ImageParts& parts, const Size& csz);
 
     void        RenderImage(const ImageString& simg, bool scroll);
-    const InlineImage& GetCachedImageData(dword id, const ImageString& simg, const Size& csz);
+    dword       GetImageId(uint64 key, bool& found);
+    const VTImageStore::Entry* GetImageEntry(dword id);
+    void        PruneImages();
+    void        ReleaseImages();
+
+    void        PostImage(dword id, uint64 key, Image&& img);
+    void        FlushImages();
+    void        RefreshImage(dword id);
+    void        CancelImages();
+
+    static uint64 GetImageKey(const ImageString& simg, const Size& csz);
+    static Size   GetImageCellSize(Size isz, const Size& csz);
+    static Size   GetImageTargetSize(const ImageString& simg, Size isz);
+    static Size   ProbeImageSize(const ImageString& simg);
+    static Image  DecodeImage(const ImageString& simg);
+
+    struct PendingImage : Moveable<PendingImage> {
+        uint64  key;
+        Size    cellsize;                                   // Reserved.
+    };
+
+    struct DecodedImage : Moveable<DecodedImage> {
+        dword   id;
+        uint64  key;
+        Image   image;
+    };
+
+    struct KittyCommand : Moveable<KittyCommand> {
+        int     action      = 't';
+        int     format      = 32;
+        int     medium      = 'd';
+        int     compression = 0;
+        int     deletion    = 'a';
+        Size    size        = Size(0, 0);                   // Of the raw pixel data.
+        int64   datasize    = 0;                            // Of the file or shared memory data.
+        int64   dataoffset  = 0;
+        Rect    source      = Rect(0, 0, 0, 0);             // x, y, w, h.
+        Size    cells       = Size(0, 0);                   // Columns, rows.
+        dword   id          = 0;
+        dword   number      = 0;
+        dword   placement   = 0;
+        int     quiet       = 0;
+        int     cursor      = 0;
+        bool    more        = false;
+    };
+
+    struct KittyImage : Moveable<KittyImage> {
+        Image   image;
+        dword   number;
+        int64   serial;
+    };
+
+    void        ParseKittyCommand(const char *s, const char *e, KittyCommand& cmd);
+    void        ExecuteKittyCommand(KittyCommand& cmd, const String& payload);
+    Image       LoadKittyImage(const KittyCommand& cmd, const String& payload, String& err);
+    bool        PlaceKittyImage(const KittyCommand& cmd, const Image& img, int64 serial);
+    void        DeleteKittyImages(const KittyCommand& cmd);
+    void        EraseImageCells(const Index<dword>& ids);
+    void        KittyReply(const KittyCommand& cmd, const String& msg);
+    void        ClearKittyImages();
+    static Image DecodeKittyImage(const KittyCommand& cmd, const void *data, int64 len, String& err);
+
+    VectorMap<dword, KittyImage> kittystore;                // By image id, in the order of transmission.
+    VectorMap<uint64, dword> kittyplacements;               // (Image id, placement id) -> cell image id.
+    KittyCommand kittychunk;                                // The first chunk of a chunked transmission.
+    VTBase64Decoder kittydata;
+    int64       kittydatasize   = 0;
+    int64       kittyserial     = 0;
+    int64       kittybytes      = 0;                        // Of the stored images.
+    bool        kittychunked    = false;
+
+    VectorMap<dword, PendingImage> pendingimages;
+    CoWorkNX    imagework;
+    Mutex       imagelock;
+    Vector<DecodedImage> decodedimages;                     // Guarded by imagelock.
+    Atomic      imagejobs       = 0;
+    int         maximagejobs    = 16;
 
     void        RenderHyperlink(const String& uri);
     String      GetCachedHyperlink(dword id, const String& data = Null);
@@ -506,9 +685,21 @@ private:
     Point       anchor          = Null;
     Point       selpos          = Null;
     dword       seltype         = SEL_NONE;
+    Vector<VTMatch> matches;
+    int         matchindex      = -1;
+    CoWorkNX    searchwork;
+    Mutex       searchlock;
+    Vector<VTMatch> searchfound;                            // Guarded by searchlock.
+    int         searchdone      = 0;                        // Finished jobs. Guarded by searchlock.
+    Vector<VTLine>  searchlines;                            // Read-only snapshot for the workers.
+    Vector<WString> searchclusters;
+    int64       searchbase      = 0;
+    Atomic      searchid        = 0;
+    Atomic      searchpending   = 0;
     bool        multiclick      = false;
     bool        ignorescroll    = false;
     bool        mousehidden     = false;
+    VTRecorder* recorder        = nullptr;
     bool        resizing        = false;
     bool        hinting         = false;
     bool        blinking        = false;
@@ -533,6 +724,8 @@ private:
     bool        sixelimages;
     bool        jexerimages;
     bool        iterm2images;
+    bool        kittyimages;
+    bool        kittyfiles;
     bool        hyperlinks;
     bool        delayedrefresh;
     bool        lazyresize;
@@ -574,14 +767,16 @@ private:
 
 private:
     void        PutChar(int c);
+    void        PutChars(const dword *cps, int n);
     int         LookupChar(int c);
+    bool        IsIdentityCharset() const                                               { return IsUtf8Mode() && gsets.IsIdentity(); }
 
     void        ParseControlChars(byte c)                                               { DispatchCtl(c); }
     void        ParseEscapeSequences(const VTInStream::Sequence& seq);
     void        ParseCommandSequences(const VTInStream::Sequence& seq);
     void        ParseDeviceControlStrings(const VTInStream::Sequence& seq);
     void        ParseOperatingSystemCommands(const VTInStream::Sequence& seq);
-    void        ParseApplicationProgrammingCommands(const VTInStream::Sequence& seq)    { WhenApplicationCommand(seq.payload); }
+    void        ParseApplicationProgrammingCommands(const VTInStream::Sequence& seq);
 
     bool        Convert7BitC1To8BitC1(const VTInStream::Sequence& seq);
 
@@ -607,6 +802,7 @@ private:
     void        ParseSixelGraphics(const VTInStream::Sequence& seq);
     void        ParseJexerGraphics(const VTInStream::Sequence& seq);
     void        ParseiTerm2Graphics(const VTInStream::Sequence& seq);
+    void        ParseKittyGraphics(const VTInStream::Sequence& seq);
 
     void        ParseHyperlinks(const VTInStream::Sequence& seq);
 
@@ -689,6 +885,7 @@ private:
     TerminalCtrl&   PutOSC(int c, int cnt = 1);
     TerminalCtrl&   PutDCS(const String& s, int cnt = 1);
     TerminalCtrl&   PutDCS(int c, int cnt = 1);
+    TerminalCtrl&   PutAPC(const String& s, int cnt = 1);
     TerminalCtrl&   PutSS2(const String& s, int cnt = 1);
     TerminalCtrl&   PutSS2(int c, int cnt = 1);
     TerminalCtrl&   PutSS3(const String& s, int cnt = 1);
@@ -754,9 +951,24 @@ private:
 
     void        SetMode(const VTInStream::Sequence& seq, bool enable);
 
-    using CbControl  = Tuple<byte, byte, Event<TerminalCtrl&, byte> >;
-    using CbFunction = Tuple<byte, byte, Event<TerminalCtrl&, const VTInStream::Sequence&> >;
-    using CbMode     = Tuple<word, byte, byte, Event<TerminalCtrl&, int, bool> >;
+    struct CbControl {
+        byte        key;
+        byte        levels;     // Bit mask of the conformance levels.
+        void      (*fn)(TerminalCtrl&, byte);
+    };
+
+    struct CbFunction {
+        dword       key;        // VTInStream::Sequence::GetHashValue()
+        byte        levels;
+        void      (*fn)(TerminalCtrl&, const VTInStream::Sequence&);
+    };
+
+    struct CbMode {
+        dword       key;        // MAKELONG(modenum, modetype)
+        word        id;
+        byte        levels;
+        void      (*fn)(TerminalCtrl&, int, bool);
+    };
 
     const CbFunction* FindFunctionPtr(const VTInStream::Sequence& seq);
     const CbMode*     FindModePtr(word modenum, byte modetype);
@@ -825,22 +1037,24 @@ public:
         byte  d[4];
         byte  ss;
         int   l, r;
+        bool  identity;
+        void  Sync();
     public:
-        GSets&     G0toGL()                                     { l = 0; return *this; }
-        GSets&     G1toGL()                                     { l = 1; return *this; }
-        GSets&     G2toGL()                                     { l = 2; return *this; }
-        GSets&     G3toGL()                                     { l = 3; return *this; }
+        GSets&     G0toGL()                                     { l = 0; Sync(); return *this; }
+        GSets&     G1toGL()                                     { l = 1; Sync(); return *this; }
+        GSets&     G2toGL()                                     { l = 2; Sync(); return *this; }
+        GSets&     G3toGL()                                     { l = 3; Sync(); return *this; }
         GSets&     G0toGR()                                     { r = 0; return *this; }
         GSets&     G1toGR()                                     { r = 1; return *this; }
         GSets&     G2toGR()                                     { r = 2; return *this; }
         GSets&     G3toGR()                                     { r = 3; return *this; }
 
-        GSets&     G0(byte c)                                   { g[0] = c; return *this; }
-        GSets&     G1(byte c)                                   { g[1] = c; return *this; }
-        GSets&     G2(byte c)                                   { g[2] = c; return *this; }
-        GSets&     G3(byte c)                                   { g[3] = c; return *this; }
-        GSets&     SS(byte c)                                   { ss   = c; return *this; }
-        GSets&     Broadcast(byte c)                            { g[0] = g[1] = g[2] = g[3] = c; return *this; }
+        GSets&     G0(byte c)                                   { g[0] = c; Sync(); return *this; }
+        GSets&     G1(byte c)                                   { g[1] = c; Sync(); return *this; }
+        GSets&     G2(byte c)                                   { g[2] = c; Sync(); return *this; }
+        GSets&     G3(byte c)                                   { g[3] = c; Sync(); return *this; }
+        GSets&     SS(byte c)                                   { ss   = c; Sync(); return *this; }
+        GSets&     Broadcast(byte c)                            { g[0] = g[1] = g[2] = g[3] = c; Sync(); return *this; }
         
         byte        Get(int c, bool allowgr = true) const       { return c < 0x80 || !allowgr ? g[l] : g[r]; }
 
@@ -855,14 +1069,18 @@ public:
         byte        GetG3() const                               { return g[3]; }
         byte        GetSS() const                               { return ss;   }
 
+        // True if no single shift is pending and GL holds neither of the DEC graphics sets,
+        // i.e. when the code points are passed through as they are in UTF-8 mode.
+        bool        IsIdentity() const                          { return identity; }
+
         void        ConformtoANSILevel1();
         void        ConformtoANSILevel2();
         void        ConformtoANSILevel3();
 
-        GSets&      ResetG0()                                   { g[0] = d[0]; return *this; }
-        GSets&      ResetG1()                                   { g[1] = d[1]; return *this; }
-        GSets&      ResetG2()                                   { g[2] = d[2]; return *this; }
-        GSets&      ResetG3()                                   { g[3] = d[3]; return *this; }
+        GSets&      ResetG0()                                   { g[0] = d[0]; Sync(); return *this; }
+        GSets&      ResetG1()                                   { g[1] = d[1]; Sync(); return *this; }
+        GSets&      ResetG2()                                   { g[2] = d[2]; Sync(); return *this; }
+        GSets&      ResetG3()                                   { g[3] = d[3]; Sync(); return *this; }
 
         void        Reset();
         void        Serialize(Stream& s);
@@ -92,6 +92,7 @@ struct TabbedTerminal : TopWindow {
 		OpenMain();
 		while(IsOpen() && !tabs.IsEmpty()) {
 			ProcessEvents();
+			bool busy = false; // Each tab reads at most PtyProcess::GetReadLimit() bytes per round.
 			for(int i = 0; i < tabs.GetCount(); i++) {
 				TerminalTab& tt = tabs[i];
 				if(!tt.Do()) {
@@ -99,8 +100,10 @@ struct TabbedTerminal : TopWindow {
 					tabs.Remove(i);
 					break;
 				}
+				busy |= tt.IsReadPending();
 			}
-			Sleep(10);
+			if(!busy)
+				Sleep(10);
 		}
 	}
 };